@@ -0,0 +1,155 @@
+#!/bin/sh
+# runs every listing in tests/ through sim8086 and checks it against the expected output
+# next to it, recording decode and execute throughput per listing as tab separated values
+#
+#   disasm: the listing decodes, and reassembling the output with nasm gives the same bytes as
+#           assembling the listing's .asm (or, without one, as the listing itself). comparing
+#           bytes rather than text sidesteps the labels, aliases and spacing of the .asm
+#   exec:   the final registers and flags match the listing's .txt. registers that are zero
+#           are left out of the .txt, and the earliest ones print no ip
+#   clocks: every instruction costs the clocks the .txt gives it, on the 8086 and, where the
+#           .txt has a second section, the 8088
+#
+# nasm is required; SKIP_NASM=1 only checks that listings decode, recorded as "decoded"
+#
+# USAGE: ./regression.sh [results file]
+
+SIM=./sim8086
+RESULTS=${1:-regression.tsv}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# listings that use the segment registers, which sim8086 does not simulate
+KNOWN_FAILURES="listing_0042_completionist_decode listing_0045_challenge_register_movs"
+
+NASM=$(command -v nasm)
+if [ -z "$NASM" ]; then
+    if [ -z "$SKIP_NASM" ]; then
+        echo "nasm not found: install it to check disassembly, or set SKIP_NASM=1 to only check decoding" >&2
+        exit 1
+    fi
+    echo "SKIP_NASM set: disassembly is only checked to decode, not to reassemble"
+fi
+
+# the .txt files come from windows
+expected() {
+    tr -d '\r' < "$1"
+}
+
+# the final state of a run, in the form the .txt prints it
+final_state() {
+    sed -n '/^Final registers:/,/^$/p' | grep -E '^ +[a-z]+: ' | grep -v ': 0x0000 ' | grep -v 'flags: *$'
+}
+
+# sim8086 prints jump displacements relative to the end of the instruction ("jne -4"), which
+# nasm would take for absolute targets; rewrite them relative to its start ("jne $-2"). jumps
+# and loops with an 8-bit displacement are 2 bytes and calls 3; a jmp is assumed short when its
+# displacement fits, since the disassembly does not say which form it was
+nasm_jumps() {
+    awk 'NF == 2 && $2 ~ /^[-+][0-9]+$/ && ($1 ~ /^(j|loop)/ || $1 == "call") {
+        n = $2 + 0
+        form = ""
+        size = 2
+        if ($1 == "call") {
+            size = 3
+        } else if ($1 == "jmp" && (n < -128 || n > 127)) {
+            form = "near "
+            size = 3
+        } else if ($1 == "jmp") {
+            form = "short "
+        }
+        printf "%s %s$%+d\n", $1, form, n + size
+        next
+    }
+    { print }'
+}
+
+# the clocks of each instruction in one section of a trace
+clock_column() {
+    grep -o 'Clocks: +[0-9]*' | cut -d+ -f2
+}
+
+# the nth "**** 8086 ****" section of a .txt, or all of it if it has no sections
+section() {
+    if grep -q '^\*\*\*\* 80' "$1"; then
+        expected "$1" | awk -v n="$2" '/^\*\*\*\* 80/ { s++ } s == n'
+    elif [ "$2" = 1 ]; then
+        expected "$1"
+    fi
+}
+
+failures=0
+printf 'listing\tdisasm\texec\tclocks\tdecode_cycles_per_inst\tdecode_minst_per_s\texec_cycles_per_inst\texec_minst_per_s\n' > "$RESULTS"
+
+for bin in tests/listing_*; do
+    case "$bin" in *.*) continue ;; esac
+    name=${bin#tests/}
+    txt=$bin.txt
+    disasm=FAIL exec=- clocks=-
+
+    if timeout 10 $SIM "$bin" > "$TMP/out.asm" 2> "$TMP/err"; then
+        disasm=decoded
+        if [ -n "$NASM" ]; then
+            disasm=FAIL
+            expected_bin=$bin
+            if [ -f "$bin.asm" ]; then
+                expected_bin=$TMP/expected.bin
+                "$NASM" -o "$expected_bin" "$bin.asm" 2> "$TMP/err" || expected_bin=
+            fi
+            { echo "bits 16"; nasm_jumps < "$TMP/out.asm"; } > "$TMP/in.asm"
+            if [ -n "$expected_bin" ] && "$NASM" -o "$TMP/out.bin" "$TMP/in.asm" 2> "$TMP/err" &&
+                    cmp -s "$expected_bin" "$TMP/out.bin"; then
+                disasm=ok
+            fi
+        fi
+    fi
+
+    if [ -f "$txt" ] && [ $disasm != FAIL ]; then
+        exec=FAIL
+        # a second section only repeats the final registers
+        section "$txt" 1 | final_state > "$TMP/expected"
+        if grep -q '^ *ip:' "$TMP/expected"; then
+            timeout 10 $SIM -quiet "$bin" 2> "$TMP/err" | final_state > "$TMP/got"
+        else
+            timeout 10 $SIM -quiet "$bin" 2> "$TMP/err" | final_state | grep -v '^ *ip:' > "$TMP/got"
+        fi
+        cmp -s "$TMP/expected" "$TMP/got" && exec=ok
+
+        if grep -q 'Clocks:' "$txt"; then
+            clocks=ok
+            n=1
+            for cpu in "" -8088; do
+                section "$txt" $n | clock_column > "$TMP/expected_clocks"
+                n=$((n + 1))
+                [ -s "$TMP/expected_clocks" ] || continue
+                timeout 10 $SIM -exec -clocks $cpu "$bin" 2> "$TMP/err" | clock_column > "$TMP/got_clocks"
+                cmp -s "$TMP/expected_clocks" "$TMP/got_clocks" || clocks=FAIL
+            done
+        fi
+    fi
+
+    decode=$(timeout 60 $SIM -bench-decode "$bin" 2> /dev/null | awk '$1 == "table:" { print $2 "\t" substr($4, 2) }')
+    [ -n "$decode" ] || decode="-\t-"
+    run="-\t-"
+    if [ -f "$txt" ]; then
+        run=$(timeout 60 $SIM -bench "$bin" 2> /dev/null | awk '$1 == "Simulated:" { print substr($4, 2) "\t" $2 }')
+        [ -n "$run" ] || run="-\t-"
+    fi
+    printf "%s\t%s\t%s\t%s\t$decode\t$run\n" "$name" $disasm $exec $clocks >> "$RESULTS"
+
+    status="$disasm $exec $clocks"
+    case "$status" in
+        *FAIL*)
+            case " $KNOWN_FAILURES " in
+                *" $name "*) echo "XFAIL $name ($status)" ;;
+                *) echo "FAIL  $name ($status)"; failures=$((failures + 1)) ;;
+            esac ;;
+        *) echo "ok    $name" ;;
+    esac
+done
+
+echo "results written to $RESULTS"
+if [ $failures -ne 0 ]; then
+    echo "$failures listing(s) failed"
+    exit 1
+fi
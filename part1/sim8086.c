@@ -1,162 +1,739 @@
 #include "sim8086.h"
 #include "sim8086_print.h"
+#include "sim8086_decode.h"
+#include "sim8086_clock.h"
+#include "sim8086_exec.h"
+#include "sim8086_block.h"
+#include "sim8086_timing.h"
+#include "sim8086_profile.h"
+#include "sim8086_sweep.h"
+#include "sim8086_packed.h"
+#include "sim8086_trace.h"
+#include "sim8086_dump.h"
+#include "sim8086_fuzz.h"
 
-Instruction decode(u8 buffer[]);
-u16 get_memory_address(EffectiveAddress* address);
-u32 get_ea_clock(EffectiveAddress *ea);
-u32 get_clock(Instruction* inst);
-void run(u8 buffer[], u32 n);
-void execute_instruction(Instruction* inst);
-void decode_rm_reg(Instruction* inst, const u8 buffer[]);
-void set_reg_operand(Instruction* inst, u8 reg, u8 wide, u8 operand_num);
-void set_effective_address_operand(Instruction* inst, const u8 buffer[], u8 wide, u8 rm, u8 mod, u8 operand_num);
-void set_immediate_operand(Instruction* inst, const u8 buffer[], u8 sign, u8 wide, u8 operand_num);
-void decode_im_to_reg(Instruction* inst, const u8 buffer[]);
-void decode_im_to_rm(Instruction* inst, const u8 buffer[]);
-void decode_acc_mem(Instruction* inst, const u8 buffer[]);
-void decode_im_to_acc(Instruction* inst, const u8 buffer[]);
-void decode_jmp(Instruction* inst, const u8 buffer[]);
-
-u16 reg_state[Reg_count] = { 0 };
-u8 flags = 0;
-u32 ip = 0;
-
-u8 memory[1024*1024] = { 0 };
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+Sim8086* create_sim(FILE *output);
+void destroy_sim(Sim8086* sim);
+void run_file(Sim8086* sim, char *filename, u32 load_address);
+void run_batch(BatchQueue* batch, u32 jobs);
+void* batch_worker(void* arg);
+void run(Sim8086* sim);
+void flush_output(void);
+void run_quiet(Sim8086* sim);
+bool get_written(Sim8086* sim, Instruction* inst, u16* value);
+void trace_execution(Sim8086* sim, Instruction* inst, u16 before, u16 flags_before);
+void write_timing(Sim8086* sim, Timing timing, u32 total);
+ICacheEntry* fetch(Sim8086* sim);
+u32 load_program(Sim8086* sim, char *filename, u32 load_address);
+void invalidate_icache(Sim8086* sim, u32 address, u32 count);
+void benchmark_decode(Sim8086* sim, u8 buffer[], u32 n);
+void benchmark_sweep(Sim8086* sim, u8 buffer[], u32 n, u64 inst_count, f64 table_cycles);
+
+// the instance writing to stdout, if any, so an error exit still flushes its output
+Sim8086 *stdout_sim = NULL;
 
 bool clocks = false;
 bool execute = false;
+bool bench_decode = false;
+bool bench_packed = false;
+bool stats = false;
+bool blocks = false;
+bool quiet = false;
+bool bench = false;
+bool is_8088 = false;
+bool prefetch = false;
+bool profiling = false;
+u32 sweep_threads = 0;
+char *trace_path = NULL;
+char *dump_path = NULL;
+char *image_path = NULL;
+char *diff_path = NULL;
+u32 dump_start = 0;
+u32 dump_length = MEMORY_SIZE;
+u32 dump_width = 64;
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         fprintf(stderr, "USAGE: %s [8086 machine code file] ...\n", argv[0]);
         exit(1);
     }
+    atexit(flush_output);
 
-    u8 buffer[BUFFER_SIZE];
+    u32 load_address = 0;
+    u32 jobs = 0;
+    BatchQueue batch = { .outdir = "." };
+    batch.files = malloc(argc * sizeof(BatchFile));
+    char *replay_path = NULL;
+    char **replay_steps = malloc(argc * sizeof(char*));
+    u32 replay_step_count = 0;
+    u32 fuzz_count = 0;
+    u64 fuzz_seed = 1;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-exec") == 0) {
             execute = true;
         } else if (strcmp(argv[i], "-clocks") == 0) {
             clocks = true;
+        } else if (strcmp(argv[i], "-bench-decode") == 0) {
+            bench_decode = true;
+        } else if (strcmp(argv[i], "-bench-packed") == 0) {
+            bench_packed = true;
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            stats = true;
+        } else if (strcmp(argv[i], "-blocks") == 0) {
+            blocks = true;
+        } else if (strcmp(argv[i], "-quiet") == 0) {
+            quiet = true;
+        } else if (strcmp(argv[i], "-8088") == 0) {
+            is_8088 = true;
+        } else if (strcmp(argv[i], "-prefetch") == 0) {
+            prefetch = true;
+        } else if (strcmp(argv[i], "-profile") == 0) {
+            quiet = true;
+            profiling = true;
+        } else if (strcmp(argv[i], "-bench") == 0) {
+            quiet = true;
+            bench = true;
+        } else if (strcmp(argv[i], "-load") == 0 && i + 1 < argc) {
+            load_address = strtoul(argv[++i], NULL, 0);
+            if (load_address >= MEMORY_SIZE) {
+                fatal("load address 0x%x is outside the 1MiB address space", load_address);
+            }
+        } else if (strcmp(argv[i], "-jobs") == 0 && i + 1 < argc) {
+            jobs = strtoul(argv[++i], NULL, 0);
+            if (jobs == 0) {
+                fatal("-jobs needs at least one thread");
+            }
+        } else if (strcmp(argv[i], "-sweep") == 0 && i + 1 < argc) {
+            sweep_threads = strtoul(argv[++i], NULL, 0);
+            if (sweep_threads == 0) {
+                fatal("-sweep needs at least one thread");
+            }
+        } else if (strcmp(argv[i], "-outdir") == 0 && i + 1 < argc) {
+            batch.outdir = argv[++i];
+        } else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+            // there is nothing to trace without executing
+            execute = true;
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-dump") == 0 && i + 1 < argc) {
+            dump_path = argv[++i];
+        } else if (strcmp(argv[i], "-dump-image") == 0 && i + 1 < argc) {
+            image_path = argv[++i];
+        } else if (strcmp(argv[i], "-diff") == 0 && i + 1 < argc) {
+            diff_path = argv[++i];
+        } else if (strcmp(argv[i], "-dump-range") == 0 && i + 1 < argc) {
+            // START:LENGTH
+            char *length = strchr(argv[++i], ':');
+            dump_start = strtoul(argv[i], NULL, 0);
+            dump_length = length ? strtoul(length + 1, NULL, 0) : MEMORY_SIZE - dump_start;
+            if (dump_start >= MEMORY_SIZE || dump_length > MEMORY_SIZE - dump_start) {
+                fatal("dump range %s is outside the 1MiB address space", argv[i]);
+            }
+        } else if (strcmp(argv[i], "-dump-width") == 0 && i + 1 < argc) {
+            dump_width = strtoul(argv[++i], NULL, 0);
+            if (dump_width == 0) {
+                fatal("-dump-width needs at least one pixel");
+            }
+        } else if (strcmp(argv[i], "-fuzz") == 0 && i + 1 < argc) {
+            fuzz_count = strtoul(argv[++i], NULL, 0);
+            if (fuzz_count == 0) {
+                fatal("-fuzz needs at least one instruction");
+            }
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            fuzz_seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (replay_path) {
+            // the remaining arguments are the steps to show
+            replay_steps[replay_step_count++] = argv[i];
+        } else if (jobs) {
+            // options apply to every file of a batch, so files are only run once all are known
+            batch.files[batch.file_count++] = (BatchFile){ argv[i], load_address };
+        } else {
+            Sim8086 *sim = create_sim(stdout);
+            sim->trace_path = trace_path;
+            sim->dump_path = dump_path;
+            sim->image_path = image_path;
+            stdout_sim = sim;
+            run_file(sim, argv[i], load_address);
+            stdout_sim = NULL;
+            destroy_sim(sim);
+        }
+    }
+
+    if (jobs) {
+        run_batch(&batch, jobs);
+    }
+    if (fuzz_count) {
+        // the fuzzed stream is decoded from memory like a loaded program
+        Sim8086 *sim = create_sim(stdout);
+        stdout_sim = sim;
+        u32 size = fuzz_decoder(sim, fuzz_count, fuzz_seed);
+        benchmark_decode(sim, sim->memory, size);
+        stdout_sim = NULL;
+        destroy_sim(sim);
+    }
+    if (replay_path) {
+        char data[64 * 1024];
+        Writer out = { stdout, data, 0, sizeof(data) };
+        replay_trace(replay_path, replay_steps, replay_step_count, &out);
+    }
+    free(replay_steps);
+    free(batch.files);
+    return batch.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// allocates a machine with zeroed registers and memory, buffering its output to the given file
+Sim8086* create_sim(FILE *output) {
+    Sim8086 *sim = calloc(1, sizeof(Sim8086));
+    if (!sim) {
+        fatal("unable to allocate simulator");
+    }
+
+    // one extra page past the end so decoding the last bytes never reads out of bounds
+    sim->memory = mmap(NULL, MEMORY_SIZE + MEMORY_GUARD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sim->memory == MAP_FAILED) {
+        fatal("unable to allocate simulator memory");
+    }
+
+    char *output_data = malloc(OUTPUT_BUFFER_SIZE);
+    if (!output_data) {
+        fatal("unable to allocate output buffer");
+    }
+    sim->out = (Writer){ output, output_data, 0, OUTPUT_BUFFER_SIZE };
+    return sim;
+}
+
+// flushes any buffered output and releases everything the machine allocated
+void destroy_sim(Sim8086* sim) {
+    flush_writer(&sim->out);
+    munmap(sim->memory, MEMORY_SIZE + MEMORY_GUARD_SIZE);
+    free(sim->out.data);
+    free(sim->profile);
+    free(sim->block_cache);
+    if (sim->trace) {
+        end_trace(sim); // keeps what was recorded before an error
+    }
+    free(sim);
+}
+
+// loads the program image in filename at load_address and disassembles, runs or benchmarks
+// it according to the command line options
+void run_file(Sim8086* sim, char *filename, u32 load_address) {
+    u32 size = load_program(sim, filename, load_address);
+    sim->code_start = load_address;
+    sim->code_end = load_address + size;
+    sim->ip = sim->code_start;
+    sim->halted = false;
+    sim->call_depth = 0;
+    reset_prefetch_queue(sim, sim->code_start);
+    if (sim->trace_path && !bench_decode && !bench_packed) {
+        begin_trace(sim, sim->trace_path);
+    }
+    if (bench_decode) {
+        benchmark_decode(sim, sim->memory + sim->code_start, size);
+    } else if (bench_packed) {
+        benchmark_packed(sim);
+    } else if (blocks && !prefetch && !profiling && !sim->trace) {
+        // blocks are timed as a whole, which rules out the queue model, per-address profiles
+        // and per-instruction traces
+        run_blocks(sim);
+    } else if (quiet || blocks) {
+        run_quiet(sim);
+    } else if (sweep_threads && !execute && !clocks) {
+        run_sweep(sim, sweep_threads);
+    } else {
+        run(sim);
+    }
+    if (sim->trace) {
+        end_trace(sim);
+    }
+
+    if (diff_path) {
+        diff_memory(sim, diff_path, dump_start, dump_length);
+    }
+    if (sim->dump_path) {
+        dump_memory(sim, sim->dump_path, dump_start, dump_length);
+    }
+    if (sim->image_path) {
+        dump_image(sim, sim->image_path, dump_start, dump_length, dump_width);
+    }
+    flush_writer(&sim->out);
+}
+
+// the name a batch file's outputs are written under: its path without the directories
+static const char* batch_name(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    return slash ? slash + 1 : filename;
+}
+
+static int compare_batch_names(const void* a, const void* b) {
+    return strcmp(batch_name(((const BatchFile*)a)->filename), batch_name(((const BatchFile*)b)->filename));
+}
+
+// runs every file of the batch on jobs threads, writing the output for each to
+// <outdir>/<file name>.out. a file that fails is reported and the rest carry on
+void run_batch(BatchQueue* batch, u32 jobs) {
+    // two files of the same name would write over each other's outputs
+    BatchFile *sorted = malloc((batch->file_count ? batch->file_count : 1) * sizeof(BatchFile));
+    if (!sorted) {
+        fatal("unable to allocate batch");
+    }
+    memcpy(sorted, batch->files, batch->file_count * sizeof(BatchFile));
+    qsort(sorted, batch->file_count, sizeof(BatchFile), compare_batch_names);
+    for (u32 i = 1; i < batch->file_count; i++) {
+        if (compare_batch_names(&sorted[i - 1], &sorted[i]) == 0) {
+            fatal("%s and %s would both write %s/%s.out", sorted[i - 1].filename, sorted[i].filename,
+                  batch->outdir, batch_name(sorted[i].filename));
+        }
+    }
+    free(sorted);
+
+    if (jobs > batch->file_count) {
+        jobs = batch->file_count ? batch->file_count : 1;
+    }
+
+    u64 start = read_cpu_timer();
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    for (u32 i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, batch) != 0) {
+            fatal("unable to start batch thread");
+        }
+    }
+    for (u32 i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    u64 elapsed = read_cpu_timer() - start;
+
+    u64 cpu_freq = estimate_cpu_timer_freq();
+    printf("Batch: %u files, %u failed, %.4fms on %u threads\n", batch->file_count, batch->failures,
+           cpu_freq ? 1000.0 * (f64)elapsed / (f64)cpu_freq : 0.0, jobs);
+}
+
+void* batch_worker(void* arg) {
+    BatchQueue *batch = arg;
+    for (;;) {
+        u32 index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (index >= batch->file_count) {
+            break;
+        }
+        BatchFile *file = &batch->files[index];
+        const char *name = batch_name(file->filename);
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s.out", batch->outdir, name);
+
+        FILE *output = fopen(path, "w");
+        if (!output) {
+            fprintf(stderr, "ERROR: unable to create %s\n", path);
+            __atomic_fetch_add(&batch->failures, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        Sim8086 *sim = create_sim(output);
+        // every file gets its own trace and memory dumps next to its output
+        char sim_trace_path[4096];
+        char sim_dump_path[4096];
+        char sim_image_path[4096];
+        if (trace_path) {
+            snprintf(sim_trace_path, sizeof(sim_trace_path), "%s/%s.trace", batch->outdir, name);
+            sim->trace_path = sim_trace_path;
+        }
+        if (dump_path) {
+            snprintf(sim_dump_path, sizeof(sim_dump_path), "%s/%s.mem", batch->outdir, name);
+            sim->dump_path = sim_dump_path;
+        }
+        if (image_path) {
+            snprintf(sim_image_path, sizeof(sim_image_path), "%s/%s.ppm", batch->outdir, name);
+            sim->image_path = sim_image_path;
+        }
+        jmp_buf on_fatal;
+        if (setjmp(on_fatal) == 0) {
+            fatal_jump = &on_fatal;
+            run_file(sim, file->filename, file->load_address);
         } else {
-            FILE *fp;
-            if ((fp = fopen(argv[i], "rb")) == NULL) {
-                fprintf(stderr, "ERROR: unable to open %s\n", argv[i]);
-                exit(1);
-            };
-            u32 bytes_read = fread(buffer, sizeof(u8), BUFFER_SIZE, fp);
-            fclose(fp);
-            run(buffer, bytes_read);
+            fprintf(stderr, "FAILED: %s\n", file->filename);
+            __atomic_fetch_add(&batch->failures, 1, __ATOMIC_RELAXED);
+        }
+        fatal_jump = NULL;
+        destroy_sim(sim);
+        fclose(output);
+    }
+    return NULL;
+}
+
+// maps the file at filename into memory at load_address, replacing whatever the previous
+// program left there; private mappings are copy-on-write so the program may modify its
+// own code without touching the file. returns the size of the image in bytes
+u32 load_program(Sim8086* sim, char *filename, u32 load_address) {
+    // fresh zeroed address space
+    if (mmap(sim->memory, MEMORY_SIZE + MEMORY_GUARD_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        fatal("unable to reset simulator memory");
+    }
+
+    int fd;
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        fatal("unable to open %s", filename);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        close(fd);
+        fatal("unable to stat %s", filename);
+    }
+    if (file_stat.st_size > MEMORY_SIZE - load_address) {
+        close(fd);
+        fatal("%s does not fit in memory at load address 0x%x", filename, load_address);
+    }
+    u32 size = (u32)file_stat.st_size;
+
+    u32 page_size = (u32)sysconf(_SC_PAGESIZE);
+    if (size && load_address % page_size == 0) {
+        if (mmap(sim->memory + load_address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            close(fd);
+            fatal("unable to map %s", filename);
         }
+    } else {
+        // mmap needs a page aligned destination, so unaligned loads are read in
+        u32 bytes_read = 0;
+        while (bytes_read < size) {
+            ssize_t n = read(fd, sim->memory + load_address + bytes_read, size - bytes_read);
+            if (n <= 0) {
+                close(fd);
+                fatal("unable to read %s", filename);
+            }
+            bytes_read += n;
+        }
+    }
+    close(fd);
+    memset(sim->dirty_pages, 0, sizeof(sim->dirty_pages));
+    if (size) {
+        mark_dirty(sim, load_address, size);
     }
-    return EXIT_SUCCESS;
+    return size;
 }
 
-void run(u8 buffer[], u32 n) {
+void flush_output(void) {
+    if (stdout_sim) {
+        flush_writer(&stdout_sim->out);
+    }
+}
+
+void reset_icache(Sim8086* sim) {
+    memset(sim->icache, 0, sizeof(sim->icache));
+    sim->icache_hits = 0;
+    sim->icache_misses = 0;
+}
+
+void print_icache_stats(Sim8086* sim) {
+    u64 lookups = sim->icache_hits + sim->icache_misses;
+    f64 hit_rate = lookups ? 100.0 * (f64)sim->icache_hits / (f64)lookups : 0.0;
+    write_char(&sim->out, '\n');
+    write_format(&sim->out, "Instruction cache: %lu hits, %lu misses (%.2f%% hit rate)\n", sim->icache_hits, sim->icache_misses, hit_rate);
+}
+
+void run(Sim8086* sim) {
     u32 time = 0;
-    while (ip < n) {
-        Instruction inst = decode(buffer);
-        ip += inst.size;
-        if (ip > n) {
-            fprintf(stderr, "ERROR: instruction exceeds disassembly region.\n");
-            exit(1);
-        }
-        print_instruction(&inst, stdout);
-        if (execute || clocks) printf(" ;");
-        if (execute) execute_instruction(&inst);
-        if (execute && clocks) printf(" |");
+    reset_icache(sim);
+    while (sim->ip < sim->code_end && !sim->halted) {
+        // only execution revisits addresses, so a plain disassembly skips the cache
+        Instruction decoded;
+        Instruction *inst;
+        ICacheEntry *entry = NULL;
+        if (execute) {
+            entry = fetch(sim);
+            inst = &entry->inst;
+        } else {
+            decoded = decode(sim->memory, sim->ip);
+            inst = &decoded;
+        }
+        sim->ip += inst->size;
+        if (sim->ip > sim->code_end) {
+            fatal("instruction exceeds disassembly region.");
+        }
+        if (execute && inst->op == OpRet && sim->call_depth == 0) {
+            entry->execute(sim, inst);
+            write_format(&sim->out, "STOPONRET: Return encountered at address %u.\n", inst->address);
+            break;
+        }
+        write_instruction(&sim->out, inst);
+        if (execute || clocks) write_bytes(&sim->out, " ;", 2);
+
+        // timed against the state before execution; without -exec jumps count as not taken
+        Timing timing = { 0 };
+        if (clocks) timing = get_timing(sim, inst);
+        u16 before = 0;
+        u16 flags_before = 0;
+        if (execute) {
+            get_written(sim, inst, &before);
+            flags_before = get_flags(sim);
+            entry->execute(sim, inst);
+            if (sim->trace) {
+                trace_step(sim);
+            }
+            if (is_jump(inst->op) && sim->ip != inst->address + inst->size) {
+                timing.base += get_taken_clocks(inst->op);
+            }
+            if (clocks && prefetch) timing.wait = prefetch_instruction(sim, inst, timing, sim->ip);
+        }
         if (clocks) {
-            u32 inst_time = get_clock(&inst);
-            time += inst_time;
-            printf(" Clock: +%u = %u", inst_time, time);
+            time += timing_total(timing);
+            write_timing(sim, timing, time);
         }
-        printf("\n");
+        if (execute && clocks) write_bytes(&sim->out, " |", 2);
+        if (execute) trace_execution(sim, inst, before, flags_before);
+        write_char(&sim->out, '\n');
     }
 
     if (execute) {
-        printf("\n");
-        printf("Final registers:\n");
-        print_registers(reg_state, ip, stdout);
+        write_char(&sim->out, '\n');
+        write_format(&sim->out, "Final registers:\n");
+        write_registers(&sim->out, sim->reg_state, sim->ip);
+    }
+    flush_writer(&sim->out);
+
+    if (execute && stats) {
+        print_icache_stats(sim);
+    }
+}
+
+// executes without the per-instruction trace, which otherwise dominates run time
+void run_quiet(Sim8086* sim) {
+    u64 inst_count = 0;
+    u64 time = 0;
+    reset_icache(sim);
+    if (profiling) {
+        begin_profile(sim);
+    }
+
+    u64 start = read_cpu_timer();
+    while (sim->ip < sim->code_end && !sim->halted) {
+        ICacheEntry *entry = fetch(sim);
+        Instruction *inst = &entry->inst;
+        sim->ip += inst->size;
+        if (sim->ip > sim->code_end) {
+            fatal("instruction exceeds disassembly region.");
+        }
+        Timing timing = get_timing(sim, inst);
+        entry->execute(sim, inst);
+        if (sim->halted) {
+            break; // a ret stops the program instead of running
+        }
+        if (sim->trace) {
+            trace_step(sim);
+        }
+        if (is_jump(inst->op) && sim->ip != inst->address + inst->size) {
+            timing.base += get_taken_clocks(inst->op);
+        }
+        if (prefetch) timing.wait = prefetch_instruction(sim, inst, timing, sim->ip);
+        time += timing_total(timing);
+        inst_count++;
+        if (profiling) {
+            profile_instruction(sim, inst, timing_total(timing), sim->ip != inst->address + inst->size);
+        }
+    }
+    u64 elapsed = read_cpu_timer() - start;
+
+    print_run_summary(sim, inst_count, time, elapsed);
+    if (profiling) {
+        print_profile(sim);
+    }
+    if (stats) {
+        print_icache_stats(sim);
     }
 }
 
-u32 get_ea_clock(EffectiveAddress *ea) {
-    if (ea->base == Ea_direct) {
-        return 6;
-    } else if (ea->base == Ea_bx || ea->base == Ea_bp || ea->base == Ea_si || ea->base == Ea_di) {
-        return (ea->displacement) ? 9 : 5;
-    } else if (ea->base == Ea_bp_di || ea->base == Ea_bx_si) {
-        return (ea->displacement) ? 11 : 7;
+// prints the final machine state of a run without a trace, and with -bench the rate at which
+// instructions were simulated over the elapsed cpu timer ticks
+void print_run_summary(Sim8086* sim, u64 inst_count, u64 time, u64 elapsed) {
+    Writer *out = &sim->out;
+    write_format(out, "Final registers:\n");
+    write_registers(out, sim->reg_state, sim->ip);
+    write_flags(out, get_flags(sim));
+    write_char(out, '\n');
+    write_format(out, "Instructions: %lu\n", inst_count);
+    write_format(out, "Estimated clocks: %lu\n", time);
+
+    if (bench) {
+        u64 cpu_freq = estimate_cpu_timer_freq();
+        f64 seconds = cpu_freq ? (f64)elapsed / (f64)cpu_freq : 0.0;
+        f64 per_second = seconds > 0.0 ? (f64)inst_count / seconds : 0.0;
+        write_char(out, '\n');
+        write_format(out, "Host time: %.4fms (%lu cycles at %lu)\n", 1000.0 * seconds, elapsed, cpu_freq);
+        write_format(out, "Simulated: %.2f Minst/s (%.2f host cycles/instruction)\n",
+               per_second / 1e6, inst_count ? (f64)elapsed / (f64)inst_count : 0.0);
+    }
+}
+
+// returns the decoded instruction at ip and its executor, decoding it only on the first visit
+ICacheEntry* fetch(Sim8086* sim) {
+    ICacheEntry *entry = &sim->icache[sim->ip & (ICACHE_SIZE - 1)];
+    if (entry->valid && entry->inst.address == sim->ip) {
+        sim->icache_hits++;
     } else {
-        return (ea->displacement) ? 12 : 8;
-    }
-}
-
-u32 get_clock(Instruction* inst) {
-    const ClockEntry op_clocks[][7] = {
-            [OpMov] = {
-                    { OperandMemory, OperandImmediate, 10, false },     // memory, accumulator
-                    { OperandImmediate, OperandMemory, 10, false },     // accumulator, memory
-                    { OperandRegister, OperandRegister, 2, false },     // register, register
-                    { OperandRegister, OperandMemory, 8, true },        // register, memory
-                    { OperandMemory, OperandRegister, 9, true },        // memory, register
-                    { OperandRegister, OperandImmediate, 4, false },    // register, immediate
-                    { OperandMemory, OperandImmediate, 10, true },      // memory, immediate
-            },
-            [OpAdd] = {
-                    { OperandRegister, OperandRegister, 3, false },     // register, register
-                    { OperandRegister, OperandMemory, 9, true },        // register, memory
-                    { OperandMemory, OperandRegister, 16, true },       // memory, register
-                    { OperandRegister, OperandImmediate, 4, false },    // register, immediate
-                    { OperandMemory, OperandImmediate, 17, true },      // memory, immediate
-                    { OperandMemory, OperandImmediate, 4, false },      // accumulator, memory
-            }
-    };
-    u32 res = 0;
-    for (int i = 0; i < 7; i++) {
-        ClockEntry entry = op_clocks[inst->op][i];
-        if (entry.dest == inst->operands[0].kind && entry.src == inst->operands[1].kind) {
-            res = entry.clock;
-            if (entry.add_ea) {
-                Operand addr = inst->operands[0].kind == OperandMemory ? inst->operands[0] : inst->operands[1];
-                res += get_ea_clock(&addr.address);
-            }
-            break;
+        sim->icache_misses++;
+        entry->inst = decode(sim->memory, sim->ip);
+        entry->execute = select_executor(&entry->inst);
+        entry->valid = true;
+    }
+    return entry;
+}
+
+// called for every memory write before it happens, to mark its page dirty; writes into the
+// program image at [code_start, code_end) must discard anything decoded from those bytes
+void code_written(Sim8086* sim, u32 address, u32 count) {
+    mark_dirty(sim, address, count);
+    if (sim->trace) {
+        trace_memory_write(sim, address, count);
+    }
+    if (address + count > sim->code_start && address < sim->code_end) {
+        invalidate_icache(sim, address, count);
+        invalidate_blocks(sim);
+    }
+}
+
+// drops cached instructions overlapping a write of count bytes at address
+void invalidate_icache(Sim8086* sim, u32 address, u32 count) {
+    u32 first = address >= MAX_INSTRUCTION_SIZE - 1 ? address - (MAX_INSTRUCTION_SIZE - 1) : 0;
+    for (u32 start = first; start < address + count; start++) {
+        ICacheEntry *entry = &sim->icache[start & (ICACHE_SIZE - 1)];
+        if (entry->valid && entry->inst.address == start && start + entry->inst.size > address) {
+            entry->valid = false;
         }
     }
-    return res;
 }
 
-u16 get_memory_address(EffectiveAddress* address) {
+// decodes the whole image repeatedly with the table driven and the legacy switch decoders,
+// checking that both produce the same instruction stream, and reports the cost of each;
+// with -sweep the parallel decoder is checked and timed as well
+void benchmark_decode(Sim8086* sim, u8 buffer[], u32 n) {
+    const u64 target_bytes = 64 * 1024 * 1024;
+    u64 repetitions = n ? (target_bytes + n - 1) / n : 0;
+
+    u64 inst_count = 0;
+    for (u32 address = 0; address < n;) {
+        Instruction table_inst = decode(buffer, address);
+        Instruction legacy_inst = decode_legacy(buffer, address);
+        if (!instructions_equal(&table_inst, &legacy_inst)) {
+            fatal("decoders disagree at address %u.", address);
+        }
+        address += table_inst.size;
+        inst_count++;
+    }
+
+    u64 table_start = read_cpu_timer();
+    for (u64 rep = 0; rep < repetitions; rep++) {
+        for (u32 address = 0; address < n;) {
+            address += decode(buffer, address).size;
+        }
+    }
+    u64 table_time = read_cpu_timer() - table_start;
+
+    u64 legacy_start = read_cpu_timer();
+    for (u64 rep = 0; rep < repetitions; rep++) {
+        for (u32 address = 0; address < n;) {
+            address += decode_legacy(buffer, address).size;
+        }
+    }
+    u64 legacy_time = read_cpu_timer() - legacy_start;
+
+    u64 cpu_freq = estimate_cpu_timer_freq();
+    f64 total = (f64)(inst_count * repetitions);
+    Writer *out = &sim->out;
+    write_format(out, "Decoded %lu instructions (%u bytes) x %lu repetitions\n", inst_count, n, repetitions);
+    write_format(out, "%8s: %.2f cycles/instruction (%.2f Minst/s)\n", "table",
+                 (f64)table_time / total, total / ((f64)table_time / (f64)cpu_freq) / 1e6);
+    write_format(out, "%8s: %.2f cycles/instruction (%.2f Minst/s)\n", "legacy",
+                 (f64)legacy_time / total, total / ((f64)legacy_time / (f64)cpu_freq) / 1e6);
+    write_format(out, "%8s: %.2fx\n", "speedup", (f64)legacy_time / (f64)table_time);
+
+    if (sweep_threads) {
+        benchmark_sweep(sim, buffer, n, inst_count, (f64)table_time / total);
+    }
+}
+
+// checks the parallel sweep against the sequential stream, then times it. each sweep starts
+// its own threads, so small images are swept fewer times than they are decoded above
+void benchmark_sweep(Sim8086* sim, u8 buffer[], u32 n, u64 inst_count, f64 table_cycles) {
+    Instruction *insts = malloc((n ? n : 1) * sizeof(Instruction));
+    u32 stop;
+    u32 count = sweep_decode(buffer, 0, n, sweep_threads, insts, &stop);
+    u32 address = 0;
+    for (u32 i = 0; i < count; i++) {
+        Instruction inst = decode(buffer, address);
+        if (!instructions_equal(&inst, &insts[i])) {
+            free(insts);
+            fatal("sweep disagrees with the sequential decoder at address %u.", address);
+        }
+        address += inst.size;
+    }
+    if (count != inst_count || stop != n) {
+        free(insts);
+        fatal("sweep stopped at address %u after %u instructions.", stop, count);
+    }
+
+    const u64 target_bytes = 64 * 1024 * 1024;
+    u64 repetitions = n ? (target_bytes / 16 + n - 1) / n : 0;
+    u64 start = read_cpu_timer();
+    for (u64 rep = 0; rep < repetitions; rep++) {
+        sweep_decode(buffer, 0, n, sweep_threads, insts, &stop);
+    }
+    u64 time = read_cpu_timer() - start;
+
+    // the same sweep on one thread: what speculating from every offset costs over the table
+    // decoder before any parallelism pays for it
+    start = read_cpu_timer();
+    for (u64 rep = 0; rep < repetitions; rep++) {
+        sweep_decode(buffer, 0, n, 1, insts, &stop);
+    }
+    u64 single_time = read_cpu_timer() - start;
+    free(insts);
+
+    u64 cpu_freq = estimate_cpu_timer_freq();
+    f64 total = (f64)(inst_count * repetitions);
+    f64 cycles = (f64)time / total;
+    f64 single_cycles = (f64)single_time / total;
+    write_format(&sim->out, "%8s: %.2f cycles/instruction (%.2f Minst/s) on %u threads x %lu repetitions, %.2fx table\n",
+                 "sweep", cycles, total / ((f64)time / (f64)cpu_freq) / 1e6, sweep_threads, repetitions,
+                 table_cycles / cycles);
+    write_format(&sim->out, "%8s: %.2f cycles/instruction on 1 thread, %+.1f%% over table, %.2fx from threads\n",
+                 "overhead", single_cycles, (single_cycles / table_cycles - 1) * 100, single_cycles / cycles);
+}
+
+u16 get_memory_address(Sim8086* sim, EffectiveAddress* address) {
     u32 base = address->base;
     u16 mem_address = 0;
     switch (base) {
         case Ea_direct:
             break;
         case Ea_bx_si: {
-            mem_address = reg_state[Reg_b] + reg_state[Reg_si];
+            mem_address = sim->reg_state[Reg_b] + sim->reg_state[Reg_si];
         } break;
         case Ea_bx_di: {
-            mem_address = reg_state[Reg_b] + reg_state[Reg_di];
+            mem_address = sim->reg_state[Reg_b] + sim->reg_state[Reg_di];
         } break;
         case Ea_bp_si: {
-            mem_address = reg_state[Reg_bp] + reg_state[Reg_si];
+            mem_address = sim->reg_state[Reg_bp] + sim->reg_state[Reg_si];
         } break;
         case Ea_bp_di: {
-            mem_address = reg_state[Reg_bp] + reg_state[Reg_di];
+            mem_address = sim->reg_state[Reg_bp] + sim->reg_state[Reg_di];
         } break;
         case Ea_si: {
-            mem_address = reg_state[Reg_si];
+            mem_address = sim->reg_state[Reg_si];
         } break;
         case Ea_di: {
-            mem_address = reg_state[Reg_di];
+            mem_address = sim->reg_state[Reg_di];
         } break;
         case Ea_bp: {
-            mem_address = reg_state[Reg_bp];
+            mem_address = sim->reg_state[Reg_bp];
         } break;
         case Ea_bx: {
-            mem_address = reg_state[Reg_b];
+            mem_address = sim->reg_state[Reg_b];
         } break;
         default:
             break;
@@ -165,373 +742,559 @@ u16 get_memory_address(EffectiveAddress* address) {
     return mem_address;
 }
 
-void execute_instruction(Instruction* inst) {
-    Operand* dest_op = &inst->operands[0];
-    Operand* src_op = &inst->operands[1];
+bool is_jump(OpType op) {
+    return op >= OpJe && op <= OpJcxz;
+}
 
-    OpType op_type = inst->op;
-    if (op_type == OpJne) {
-        if (!(flags & Zero_flag)) {
-            i32 jmp_size = inst->operands[0].s_immediate;
-            ip += jmp_size;
-        }
-        return;
+// any op that may move ip somewhere other than the next instruction
+bool is_branch(OpType op) {
+    return is_jump(op) || op == OpCall || op == OpJmp || op == OpRet;
+}
+
+// decides whether a jump is taken; the loop instructions decrement cx as part of the test
+bool branch_taken(Sim8086* sim, Instruction* inst) {
+    switch (inst->op) {
+        case OpJe ... OpJns:
+            return condition_holds(sim, inst->op);
+        case OpLoop:
+            return --sim->reg_state[Reg_c] != 0;
+        case OpLoopz:
+            return --sim->reg_state[Reg_c] != 0 && get_flag(sim, Zero_flag);
+        case OpLoopnz:
+            return --sim->reg_state[Reg_c] != 0 && !get_flag(sim, Zero_flag);
+        case OpJcxz:
+            return sim->reg_state[Reg_c] == 0;
+        default:
+            return false;
+    }
+}
+
+// returns the bytes a register or memory operand occupies. a byte register is the low or high
+// half of its 16-bit register, offset bytes in on the little endian hosts this runs on
+static inline u8* get_location(Sim8086* sim, Operand* operand) {
+    if (operand->kind == OperandRegister) {
+        return (u8*)&sim->reg_state[operand->reg.index] + operand->reg.offset;
     }
+    return &sim->memory[get_memory_address(sim, &operand->address)];
+}
+
+static inline u16 load(u8* location, bool wide) {
+    return wide ? *(u16*)location : *location;
+}
 
-    // determine destination address
-    u16 *dest;
-    if (dest_op->kind == OperandRegister) {
-        RegisterAccess reg = dest_op->reg;
-        dest = &reg_state[reg.index];
-    } else if (dest_op->kind == OperandMemory) {
-        dest = (u16*)&memory[get_memory_address(&dest_op->address)];
+static inline void store(u8* location, u16 value, bool wide) {
+    if (wide) {
+        *(u16*)location = value;
     } else {
-        assert(false);
+        *location = (u8)value;
+    }
+}
+
+// reads the register or memory an instruction writes into value, or returns false if it only
+// writes flags or ip. a byte register reads as the whole register it is half of; ops with
+// implied operands report the one register that tells most about what they did
+bool get_written(Sim8086* sim, Instruction* inst, u16* value) {
+    switch (inst->op) {
+        case OpCmp:
+        case OpTest:
+        case OpJmp:
+        case OpJe ... OpJns:
+        case OpJcxz:
+            return false;
+        case OpLoop:
+        case OpLoopz:
+        case OpLoopnz:
+            *value = sim->reg_state[Reg_c];
+            return true;
+        case OpPush:
+        case OpCall:
+        case OpRet:
+            *value = sim->reg_state[Reg_sp];
+            return true;
+        case OpMul:
+        case OpImul:
+        case OpDiv:
+        case OpIdiv:
+        case OpCbw:
+        case OpLods:
+            *value = sim->reg_state[Reg_a];
+            return true;
+        case OpCwd:
+            *value = sim->reg_state[Reg_d];
+            return true;
+        case OpMovs:
+        case OpStos:
+            *value = sim->reg_state[Reg_di];
+            return true;
+        default: {
+            Operand *dest_op = &inst->operands[0];
+            if (dest_op->kind == OperandRegister) {
+                *value = sim->reg_state[dest_op->reg.index];
+            } else {
+                *value = load(get_location(sim, dest_op), inst->flags & FlagWide);
+            }
+            return true;
+        }
+    }
+}
+
+// op and wide are constants in every caller below, so each executor compiles down to the
+// one operation at one width with no checks left on either
+static inline void execute_op(Sim8086* sim, Instruction* inst, OpType op, bool wide) {
+    Operand* dest_op = &inst->operands[0];
+    Operand* src_op = &inst->operands[1];
+    u16 mask = wide ? 0xffff : 0xff;
+
+    u8 *dest = get_location(sim, dest_op);
+    if (dest_op->kind == OperandMemory && op != OpCmp && op != OpTest) {
+        code_written(sim, (u32)(dest - sim->memory), wide ? 2 : 1);
     }
 
-    // determine src
-    u16 src;
+    // shift and rotate counts are always a byte: 1 or cl
+    bool shift = op == OpShl || op == OpShr || (op >= OpSar && op <= OpRcr);
+    u16 src = 0;
     if (src_op->kind == OperandImmediate) {
-        src = (u16)src_op->immediate;
-    } else if (src_op->kind == OperandRegister) {
-        src = reg_state[src_op->reg.index];
-    } else if (src_op->kind == OperandMemory) {
-        src = memory[get_memory_address(&src_op->address)];
-    } else {
-        src = 0;
+        src = (u16)src_op->immediate & mask;
+    } else if (src_op->kind == OperandRegister || src_op->kind == OperandMemory) {
+        src = load(get_location(sim, src_op), wide && !shift);
     }
 
-    // do operation
-    u16 before = *dest;
-    switch (op_type) {
+    u16 value = load(dest, wide);
+    switch (op) {
         case OpMov: {
-            *dest = src;
+            store(dest, src, wide);
             break;
         }
         case OpAdd: {
-            *dest += src;
+            u16 result = (value + src) & mask;
+            record_flags(sim, op, value, src, result, wide);
+            store(dest, result, wide);
             break;
         }
         case OpSub:
         case OpCmp: {
-            u16 res = *dest - src;
-
-            if ((res >> 15) & 1) flags |= Sign_flag;
-            else flags &= ~(Sign_flag);
-
-            if (res == 0) flags |= Zero_flag;
-            else flags &= ~(Zero_flag);
-
-            if (op_type == OpSub) *dest -= src;
+            u16 result = (value - src) & mask;
+            record_flags(sim, op, value, src, result, wide);
+            if (op == OpSub) store(dest, result, wide);
             break;
         }
-        default:
+        case OpAdc:
+        case OpSbb: {
+            bool carry = get_flag(sim, Carry_flag);
+            u16 result = (op == OpAdc ? value + src + carry : value - src - carry) & mask;
+            record_flags_carry_in(sim, op, value, src, result, wide, carry);
+            store(dest, result, wide);
             break;
-    }
-    if (op_type != OpCmp) {
-        printf(" 0x%x->0x%x", before, *dest);
-    }
-    printf(" ip:0x%x->0x%x", inst->address, ip);
-    if (op_type == OpSub || op_type == OpCmp) {
-        printf(" flags:");
-        if (flags & Zero_flag) printf("Z");
-        if (flags & Sign_flag) printf("S");
-    }
-}
-
-Instruction decode(u8 buffer[]) {
-    Instruction inst;
-    inst.address = ip;
-    inst.op = OpNone;
-    inst.flags = 0;
-
-    u8 opcode = buffer[inst.address];
-
-    // check for jump opcodes
-    switch (opcode) {
-        case 0b01110100:
-            inst.op = OpJe;
-            break;
-        case 0b01111100:
-            inst.op = OpJl;
-            break;
-        case 0b01111110:
-            inst.op = OpJle;
-            break;
-        case 0b01110010:
-            inst.op = OpJb;
-            break;
-        case 0b01110110:
-            inst.op = OpJbe;
-            break;
-        case 0b01111010:
-            inst.op = OpJp;
-            break;
-        case 0b01110000:
-            inst.op = OpJo;
-            break;
-        case 0b01111000:
-            inst.op = OpJs;
-            break;
-        case 0b01110101:
-            inst.op = OpJne;
-            break;
-        case 0b01111101:
-            inst.op = OpJnl;
-            break;
-        case 0b01111111:
-            inst.op = OpJnle;
-            break;
-        case 0b01110011:
-            inst.op = OpJnb;
+        }
+        case OpAnd:
+        case OpOr:
+        case OpXor: {
+            u16 result = op == OpAnd ? value & src : op == OpOr ? value | src : value ^ src;
+            record_flags(sim, op, 0, 0, result, wide);
+            store(dest, result, wide);
             break;
-        case 0b01110111:
-            inst.op = OpJnbe;
+        }
+        case OpNot: {
+            store(dest, ~value, wide);
             break;
-        case 0b01111011:
-            inst.op = OpJnp;
+        }
+        case OpNeg: {
+            // flags as for subtracting from zero
+            u16 result = -value & mask;
+            record_flags(sim, OpSub, 0, value, result, wide);
+            store(dest, result, wide);
             break;
-        case 0b01110001:
-            inst.op = OpJno;
+        }
+        case OpTest: {
+            record_flags(sim, op, 0, 0, value & src, wide);
             break;
-        case 0b01111001:
-            inst.op = OpJns;
+        }
+        case OpInc: {
+            u16 result = (value + 1) & mask;
+            record_flags_keep_carry(sim, op, value, 1, result, wide);
+            store(dest, result, wide);
             break;
-        case 0b11100010:
-            inst.op = OpLoop;
+        }
+        case OpDec: {
+            u16 result = (value - 1) & mask;
+            record_flags_keep_carry(sim, op, value, 1, result, wide);
+            store(dest, result, wide);
             break;
-        case 0b11100001:
-            inst.op = OpLoopz;
+        }
+        case OpShl:
+        case OpShr: {
+            // a count of zero leaves the flags alone
+            u16 count = src & 0xff;
+            if (count == 0) break;
+            u16 result = count >= 16 ? 0 : (op == OpShl ? value << count : value >> count) & mask;
+            record_flags(sim, op, value, count, result, wide);
+            store(dest, result, wide);
             break;
-        case 0b11100000:
-            inst.op = OpLoopnz;
+        }
+        case OpSar: {
+            u16 count = src & 0xff;
+            if (count == 0) break;
+            i32 signed_value = wide ? (i16)value : (i8)value;
+            u16 result = (signed_value >> (count > 15 ? 15 : count)) & mask;
+            record_flags(sim, op, value, count, result, wide);
+            store(dest, result, wide);
             break;
-        case 0b11100011:
-            inst.op = OpJcxz;
+        }
+        case OpRol:
+        case OpRor:
+        case OpRcl:
+        case OpRcr: {
+            u16 count = src & 0xff;
+            if (count == 0) break;
+            u32 bits = wide ? 16 : 8;
+            u16 sign = wide ? 0x8000 : 0x80;
+            u16 result;
+            bool carry;
+            if (op == OpRol || op == OpRor) {
+                u32 n = count % bits;
+                result = (op == OpRol ? value << n | value >> (bits - n) : value >> n | value << (bits - n)) & mask;
+                carry = op == OpRol ? result & 1 : (result & sign) != 0;
+            } else {
+                // rotates through carry turn a value one bit wider than the operand
+                u32 n = count % (bits + 1);
+                u32 extended = value | (u32)get_flag(sim, Carry_flag) << bits;
+                u32 rotated = op == OpRcl ? extended << n | extended >> (bits + 1 - n) : extended >> n | extended << (bits + 1 - n);
+                result = rotated & mask;
+                carry = (rotated >> bits) & 1;
+            }
+            // overflow is only defined for single bit rotates
+            bool overflow = op == OpRol || op == OpRcl ? ((result & sign) != 0) != carry
+                                                       : ((result ^ result << 1) & sign) != 0;
+            record_carry_overflow(sim, op, carry, overflow);
+            store(dest, result, wide);
             break;
+        }
         default:
             break;
     }
+}
 
-    if (inst.op != OpNone) { // must have matched a jmp code
-        decode_jmp(&inst, buffer);
-        return inst;
-    }
-
-    // opcodes of len 7
-    opcode >>= 1;
-    switch (opcode) {
-        case 0b1100011:
-            inst.op = OpMov;
-            decode_im_to_rm(&inst, buffer);
-            return inst;
-        case 0b1010000:
-        case 0b1010001:
-            inst.op = OpMov;
-            decode_acc_mem(&inst, buffer);
-            return inst;
-        case 0b0000010:
-            inst.op = OpAdd;
-            decode_im_to_acc(&inst, buffer);
-            return inst;
-        case 0b0010110:
-            inst.op = OpSub;
-            decode_im_to_acc(&inst, buffer);
-            return inst;
-        case 0b0011110:
-            inst.op = OpCmp;
-            decode_im_to_acc(&inst, buffer);
-            return inst;
-        default:
-            break;
+// mul and imul multiply the accumulator by the operand into ax, or dx:ax for words
+static inline void execute_multiply(Sim8086* sim, Instruction* inst, OpType op, bool wide) {
+    u16 src = load(get_location(sim, &inst->operands[0]), wide);
+    u16 *ax = &sim->reg_state[Reg_a];
+    u16 *dx = &sim->reg_state[Reg_d];
+    bool upper; // the product does not fit the lower half
+    if (wide) {
+        u32 product = op == OpMul ? (u32)*ax * src : (u32)((i32)(i16)*ax * (i16)src);
+        *ax = (u16)product;
+        *dx = (u16)(product >> 16);
+        upper = op == OpMul ? *dx != 0 : (i32)product != (i16)*ax;
+    } else {
+        u16 product = op == OpMul ? (u8)*ax * src : (u16)((i8)*ax * (i8)src);
+        *ax = product;
+        upper = op == OpMul ? (product >> 8) != 0 : (i16)product != (i8)product;
     }
+    record_carry_overflow(sim, op, upper, upper);
+}
 
-    // opcodes of len 6
-    opcode >>= 1;
-    switch (opcode) {
-        case 0b100010:
-            inst.op = OpMov;
-            decode_rm_reg(&inst, buffer);
-            return inst;
-        case 0b000000:
-            inst.op = OpAdd;
-            decode_rm_reg(&inst, buffer);
-            return inst;
-        case 0b001010:
-            inst.op = OpSub;
-            decode_rm_reg(&inst, buffer);
-            return inst;
-        case 0b001110:
-            inst.op = OpCmp;
-            decode_rm_reg(&inst, buffer);
-            return inst;
-        case 0b100000:
-            decode_im_to_rm(&inst, buffer);
-            return inst;
-        default:
-            break;
+// div and idiv divide ax, or dx:ax for words, by the operand into a quotient in al (ax) and a
+// remainder in ah (dx). there are no interrupts, so a divide error stops the run
+static inline void execute_divide(Sim8086* sim, Instruction* inst, OpType op, bool wide) {
+    u16 src = load(get_location(sim, &inst->operands[0]), wide);
+    u16 *ax = &sim->reg_state[Reg_a];
+    u16 *dx = &sim->reg_state[Reg_d];
+    i64 dividend;
+    i64 divisor;
+    if (op == OpDiv) {
+        dividend = wide ? (u32)*dx << 16 | *ax : *ax;
+        divisor = src;
+    } else {
+        dividend = wide ? (i32)((u32)*dx << 16 | *ax) : (i16)*ax;
+        divisor = wide ? (i16)src : (i8)src;
     }
-
-    // opcodes of len 4
-    opcode >>= 2;
-    switch (opcode) {
-        case 0b1011:
-            inst.op = OpMov;
-            decode_im_to_reg(&inst, buffer);
-            return inst;
-        default:
-            break;
+    i64 quotient = divisor ? dividend / divisor : 0;
+    i64 limit = op == OpDiv ? (wide ? 0xffff : 0xff) : (wide ? 0x7fff : 0x7f);
+    if (divisor == 0 || quotient > limit || quotient < (op == OpDiv ? 0 : -limit)) {
+        fatal("divide error at address %u.", inst->address);
+    }
+    u16 remainder = (u16)(dividend % divisor);
+    if (wide) {
+        *ax = (u16)quotient;
+        *dx = remainder;
+    } else {
+        *ax = (u16)(remainder << 8 | (u8)quotient);
     }
+}
 
-    if (inst.op == OpNone) {
-        fprintf(stderr, "ERROR: unknown opcode encountered.\n");
-        exit(1);
+// string ops step si and di forward; the direction flag is not simulated. a repeated op runs
+// all cx iterations as bulk memory operations, split only where si or di wraps around
+static inline void execute_string(Sim8086* sim, Instruction* inst, OpType op, bool wide) {
+    u32 size = wide ? 2 : 1;
+    u32 count = inst->flags & FlagRep ? sim->reg_state[Reg_c] : 1;
+    u16 *si = &sim->reg_state[Reg_si];
+    u16 *di = &sim->reg_state[Reg_di];
+    u8 *memory = sim->memory;
+    while (count) {
+        u32 n = count;
+        u32 si_left = (0x10000 - *si + size - 1) / size;
+        u32 di_left = (0x10000 - *di + size - 1) / size;
+        if (op != OpStos && n > si_left) n = si_left;
+        if (op != OpLods && n > di_left) n = di_left;
+        u32 bytes = n * size;
+
+        switch (op) {
+            case OpMovs: {
+                code_written(sim, *di, bytes);
+                if (*di > *si && *di < *si + bytes) {
+                    // a destination just ahead of the source sees the bytes already copied
+                    for (u32 i = 0; i < bytes; i += size) {
+                        store(memory + *di + i, load(memory + *si + i, wide), wide);
+                    }
+                } else {
+                    memmove(memory + *di, memory + *si, bytes);
+                }
+                *si += bytes;
+                *di += bytes;
+                break;
+            }
+            case OpStos: {
+                code_written(sim, *di, bytes);
+                if (wide) {
+                    for (u32 i = 0; i < bytes; i += 2) {
+                        *(u16*)(memory + *di + i) = sim->reg_state[Reg_a];
+                    }
+                } else {
+                    memset(memory + *di, (u8)sim->reg_state[Reg_a], bytes);
+                }
+                *di += bytes;
+                break;
+            }
+            case OpLods: {
+                // only the last element loaded is left in the accumulator
+                store((u8*)&sim->reg_state[Reg_a], load(memory + *si + bytes - size, wide), wide);
+                *si += bytes;
+                break;
+            }
+            default:
+                break;
+        }
+        count -= n;
+    }
+    if (inst->flags & FlagRep) {
+        sim->reg_state[Reg_c] = 0;
     }
+}
+
+#define EXECUTORS(name, op, execute) \
+    static void execute_##name##_byte(Sim8086* sim, Instruction* inst) { execute(sim, inst, op, false); } \
+    static void execute_##name##_word(Sim8086* sim, Instruction* inst) { execute(sim, inst, op, true); }
 
-    return inst;
+EXECUTORS(mov, OpMov, execute_op)
+EXECUTORS(add, OpAdd, execute_op)
+EXECUTORS(sub, OpSub, execute_op)
+EXECUTORS(cmp, OpCmp, execute_op)
+EXECUTORS(xor, OpXor, execute_op)
+EXECUTORS(test, OpTest, execute_op)
+EXECUTORS(inc, OpInc, execute_op)
+EXECUTORS(dec, OpDec, execute_op)
+EXECUTORS(shl, OpShl, execute_op)
+EXECUTORS(shr, OpShr, execute_op)
+EXECUTORS(and, OpAnd, execute_op)
+EXECUTORS(or, OpOr, execute_op)
+EXECUTORS(adc, OpAdc, execute_op)
+EXECUTORS(sbb, OpSbb, execute_op)
+EXECUTORS(not, OpNot, execute_op)
+EXECUTORS(neg, OpNeg, execute_op)
+EXECUTORS(sar, OpSar, execute_op)
+EXECUTORS(rol, OpRol, execute_op)
+EXECUTORS(ror, OpRor, execute_op)
+EXECUTORS(rcl, OpRcl, execute_op)
+EXECUTORS(rcr, OpRcr, execute_op)
+EXECUTORS(mul, OpMul, execute_multiply)
+EXECUTORS(imul, OpImul, execute_multiply)
+EXECUTORS(div, OpDiv, execute_divide)
+EXECUTORS(idiv, OpIdiv, execute_divide)
+EXECUTORS(movs, OpMovs, execute_string)
+EXECUTORS(stos, OpStos, execute_string)
+EXECUTORS(lods, OpLods, execute_string)
+
+static void execute_cbw(Sim8086* sim, Instruction* inst) {
+    sim->reg_state[Reg_a] = (u16)(i8)sim->reg_state[Reg_a];
 }
 
-void decode_jmp(Instruction* inst, const u8 buffer[]) {
-    Operand signed_immediate;
-    signed_immediate.kind = OperandRelativeImmediate;
-    signed_immediate.s_immediate = (i32)(i8)buffer[inst->address + 1];
-    inst->operands[0] = signed_immediate;
-    Operand none;
-    none.kind = OperandNone;
-    inst->operands[1] = none;
-    inst->size = 2;
+static void execute_cwd(Sim8086* sim, Instruction* inst) {
+    sim->reg_state[Reg_d] = sim->reg_state[Reg_a] & 0x8000 ? 0xffff : 0;
 }
 
-void decode_im_to_acc(Instruction* inst, const u8 buffer[]) {
-    u32 idx = inst->address;
-    u8 w = buffer[idx] & 1;
-    inst->size = 1;
-    set_reg_operand(inst, 0, w, 0);
-    set_immediate_operand(inst, buffer, 0, w, 1);
+// the stack lives in the first 64k of memory, there being no stack segment
+static inline void push_word(Sim8086* sim, u16 value) {
+    u16 sp = sim->reg_state[Reg_sp] -= 2;
+    code_written(sim, sp, 2);
+    *(u16*)&sim->memory[sp] = value;
 }
 
-void decode_acc_mem(Instruction* inst, const u8 buffer[]) {
-    u32 idx = inst->address;
-    u8 to_memory = (buffer[idx] >> 1) & 1;
-    u8 w = buffer[idx] & 1;
-    inst->size = 1;
-    set_reg_operand(inst, 0, w, to_memory);
-    set_effective_address_operand(inst, buffer, w, 0b110, 0b00, to_memory ? 0 : 1);
+static inline u16 pop_word(Sim8086* sim) {
+    u16 value = *(u16*)&sim->memory[sim->reg_state[Reg_sp]];
+    sim->reg_state[Reg_sp] += 2;
+    return value;
 }
 
-void decode_im_to_rm(Instruction* inst, const u8 buffer[]) {
-    u32 idx = inst->address;
-    u8 s = (buffer[idx] >> 1) & 1;
-    u8 w = buffer[idx] & 1;
-    idx++;
-    u8 mod = buffer[idx] >> 6;
-    u8 op_type = (buffer[idx] >> 3) & 0b111;
-    u8 rm = buffer[idx] & 0b111;
+static void execute_push(Sim8086* sim, Instruction* inst) {
+    // the 8086 pushes sp as it is after the decrement
+    u16 sp = sim->reg_state[Reg_sp] -= 2;
+    u16 value = load(get_location(sim, &inst->operands[0]), true);
+    code_written(sim, sp, 2);
+    *(u16*)&sim->memory[sp] = value;
+}
 
-    if (inst->op != OpMov && op_type == 0b000) {
-        inst->op = OpAdd;
-    } else if (op_type == 0b101) {
-        inst->op = OpSub;
-    } else if (op_type == 0b111) {
-        inst->op = OpCmp;
+static void execute_pop(Sim8086* sim, Instruction* inst) {
+    u16 value = pop_word(sim);
+    Operand *dest_op = &inst->operands[0];
+    u8 *dest = get_location(sim, dest_op);
+    if (dest_op->kind == OperandMemory) {
+        code_written(sim, (u32)(dest - sim->memory), 2);
     }
+    store(dest, value, true);
+}
 
-    inst->size = 2;
-    if (mod == 0b11) {
-        set_reg_operand(inst, rm, w, 0);
-    } else {
-        set_effective_address_operand(inst, buffer, w, rm, mod, 0);
-    }
-    set_immediate_operand(inst, buffer, inst->op == OpMov ? 0 : s, w, 1);
-}
-
-void decode_im_to_reg(Instruction* inst, const u8 buffer[]) {
-    u32 idx = inst->address;
-    u8 w = (buffer[idx] >> 3) & 1;
-    u8 reg = buffer[idx] & 0b111;
-    set_reg_operand(inst, reg, w, 0);
-    inst->size = 1;
-    set_immediate_operand(inst, buffer, 0, w, 1);
-}
-
-void decode_rm_reg(Instruction* inst, const u8 buffer[]) {
-    u32 idx = inst->address;
-    u8 d = (buffer[idx] >> 1) & 1;
-    u8 w = buffer[idx] & 1;
-    idx++;
-    u8 mod = buffer[idx] >> 6;
-    u8 reg = (buffer[idx] >> 3) & 0b111;
-    u8 rm = buffer[idx] & 0b111;
-    inst->size = 2;
-    if (mod == 0b11) {
-        set_reg_operand(inst, rm, w, d);
-    } else {
-        set_effective_address_operand(inst, buffer, w, rm, mod, d);
+// code_start stands in for the code segment: return addresses and indirect targets are
+// offsets from it
+static u32 get_target(Sim8086* sim, Instruction* inst) {
+    Operand *target = &inst->operands[0];
+    if (target->kind == OperandRelativeImmediate) {
+        return sim->ip + target->s_immediate;
     }
-    set_reg_operand(inst, reg, w, d ? 0 : 1);
+    return sim->code_start + load(get_location(sim, target), true);
 }
 
-void set_reg_operand(Instruction* inst, u8 reg, u8 wide, u8 operand_num) {
-    if (wide) {
-        inst->flags |= FlagWide;
-    }
-    const RegisterAccess reg_table[][2] = {
-        {{Reg_a, 0, 1}, {Reg_a, 0, 2}},
-        {{Reg_c, 0, 1}, {Reg_c, 0, 2}},
-        {{Reg_d, 0, 1}, {Reg_d, 0, 2}},
-        {{Reg_b, 0, 1}, {Reg_b, 0, 2}},
-        {{Reg_a, 1, 1}, {Reg_sp, 0, 2}},
-        {{Reg_c, 1, 1}, {Reg_bp, 0, 2}},
-        {{Reg_d, 1, 1}, {Reg_si, 0, 2}},
-        {{Reg_b, 1, 1}, {Reg_di, 0, 2}},
-    };
-    Operand res;
-    res.kind = OperandRegister;
-    res.reg = reg_table[reg][wide];
-    inst->operands[operand_num] = res;
-}
-
-void set_effective_address_operand(Instruction* inst, const u8 buffer[], u8 wide, u8 rm, u8 mod, u8 operand_num) {
-    Operand res;
-    res.kind = OperandMemory;
-    if (wide) {
-        inst->flags |= FlagWide;
+static void execute_call(Sim8086* sim, Instruction* inst) {
+    u32 target = get_target(sim, inst);
+    push_word(sim, (u16)(sim->ip - sim->code_start));
+    sim->call_depth++;
+    sim->ip = target;
+}
+
+static void execute_jmp(Sim8086* sim, Instruction* inst) {
+    sim->ip = get_target(sim, inst);
+}
+
+static void execute_jump(Sim8086* sim, Instruction* inst) {
+    if (branch_taken(sim, inst)) {
+        sim->ip += inst->operands[0].s_immediate;
     }
-    if (mod == 0b00 && rm == 0b110) {
-        res.address.base = Ea_direct;
-    } else {
-        res.address.base = (EffectiveAddressBase) (rm + 1);
-    }
-    res.address.displacement = 0;
-    u32 idx = inst->address + inst->size - 1;
-    if (mod == 0b10 || (mod == 0b00 && rm == 0b110)) {
-        idx += 2;
-        res.address.displacement = (i16)(buffer[idx] << 8) | buffer[idx-1]; // parse as signed
-        inst->size += 2;
-    } else if (mod == 0b01) {
-        idx += 1;
-        res.address.displacement = (i16)(buffer[idx] << 8) >> 8; // sign extend to 16 bits
-        inst->size += 1;
-    }
-    inst->operands[operand_num] = res;
-}
-
-void set_immediate_operand(Instruction* inst, const u8 buffer[], u8 sign, u8 wide, u8 operand_num) {
-    Operand res;
-    res.kind = OperandImmediate;
-    u32 idx = inst->address + inst->size - 1;
-    if (sign == 0 && wide == 1) {
-        idx += 2;
-        res.immediate = (u32)((buffer[idx] << 8) | buffer[idx-1]);
-        inst->size += 2;
-    } else {
-        idx += 1;
-        if (sign == 1 && wide == 1) {
-            res.immediate = (i16)(buffer[idx] << 8) >> 8; // sign extend to 16 bits
-        } else {
-            res.immediate = (u32)(buffer[idx]);
+}
+
+static void execute_ret(Sim8086* sim, Instruction* inst) {
+    if (sim->call_depth == 0) {
+        // returning from the program itself ends it at the ret
+        sim->halted = true;
+        sim->ip = inst->address;
+        return;
+    }
+    sim->call_depth--;
+    sim->ip = sim->code_start + pop_word(sim);
+    if (inst->operands[0].kind == OperandImmediate) {
+        sim->reg_state[Reg_sp] += inst->operands[0].immediate;
+    }
+}
+
+static void execute_none(Sim8086* sim, Instruction* inst) {
+}
+
+// [op][wide]
+static ExecuteFunction *const executors[OpCount][2] = {
+        [OpNone] = { execute_none, execute_none },
+        [OpMov] = { execute_mov_byte, execute_mov_word },
+        [OpAdd] = { execute_add_byte, execute_add_word },
+        [OpSub] = { execute_sub_byte, execute_sub_word },
+        [OpCmp] = { execute_cmp_byte, execute_cmp_word },
+        [OpXor] = { execute_xor_byte, execute_xor_word },
+        [OpTest] = { execute_test_byte, execute_test_word },
+        [OpInc] = { execute_inc_byte, execute_inc_word },
+        [OpDec] = { execute_dec_byte, execute_dec_word },
+        [OpShl] = { execute_shl_byte, execute_shl_word },
+        [OpShr] = { execute_shr_byte, execute_shr_word },
+        [OpAnd] = { execute_and_byte, execute_and_word },
+        [OpOr] = { execute_or_byte, execute_or_word },
+        [OpAdc] = { execute_adc_byte, execute_adc_word },
+        [OpSbb] = { execute_sbb_byte, execute_sbb_word },
+        [OpNot] = { execute_not_byte, execute_not_word },
+        [OpNeg] = { execute_neg_byte, execute_neg_word },
+        [OpSar] = { execute_sar_byte, execute_sar_word },
+        [OpRol] = { execute_rol_byte, execute_rol_word },
+        [OpRor] = { execute_ror_byte, execute_ror_word },
+        [OpRcl] = { execute_rcl_byte, execute_rcl_word },
+        [OpRcr] = { execute_rcr_byte, execute_rcr_word },
+        [OpMul] = { execute_mul_byte, execute_mul_word },
+        [OpImul] = { execute_imul_byte, execute_imul_word },
+        [OpDiv] = { execute_div_byte, execute_div_word },
+        [OpIdiv] = { execute_idiv_byte, execute_idiv_word },
+        [OpCbw] = { execute_cbw, execute_cbw },
+        [OpCwd] = { execute_cwd, execute_cwd },
+        [OpPush] = { execute_push, execute_push },
+        [OpPop] = { execute_pop, execute_pop },
+        [OpMovs] = { execute_movs_byte, execute_movs_word },
+        [OpStos] = { execute_stos_byte, execute_stos_word },
+        [OpLods] = { execute_lods_byte, execute_lods_word },
+        [OpCall] = { execute_call, execute_call },
+        [OpJmp] = { execute_jmp, execute_jmp },
+        [OpRet] = { execute_ret, execute_ret },
+        [OpJe ... OpJcxz] = { execute_jump, execute_jump },
+};
+
+// picks the executor for an instruction's op and width
+ExecuteFunction* select_executor(Instruction* inst) {
+    return executors[inst->op][(inst->flags & FlagWide) != 0];
+}
+
+// runs an instruction that has no executor picked for it yet
+void execute_instruction(Sim8086* sim, Instruction* inst) {
+    select_executor(inst)(sim, inst);
+}
+
+// writes " Clocks: +N = T", followed by the breakdown of N when it has more than a base
+void write_timing(Sim8086* sim, Timing timing, u32 total) {
+    write_bytes(&sim->out, " Clocks: +", 10);
+    write_u32(&sim->out, timing_total(timing));
+    write_bytes(&sim->out, " = ", 3);
+    write_u32(&sim->out, total);
+    if (timing.ea || timing.penalty || timing.wait) {
+        write_bytes(&sim->out, " (", 2);
+        write_u32(&sim->out, timing.base);
+        if (timing.ea) {
+            write_bytes(&sim->out, " + ", 3);
+            write_u32(&sim->out, timing.ea);
+            write_bytes(&sim->out, "ea", 2);
+        }
+        if (timing.penalty) {
+            write_bytes(&sim->out, " + ", 3);
+            write_u32(&sim->out, timing.penalty);
+            write_char(&sim->out, 'p');
+        }
+        if (timing.wait) {
+            write_bytes(&sim->out, " + ", 3);
+            write_u32(&sim->out, timing.wait);
+            write_char(&sim->out, 'q'); // stalled on the prefetch queue
         }
-        inst->size += 1;
+        write_char(&sim->out, ')');
+    }
+}
+
+// prints the effect of an instruction that has just been executed; before and flags_before
+// are the written value (see get_written) and flags prior to execution
+void trace_execution(Sim8086* sim, Instruction* inst, u16 before, u16 flags_before) {
+    u16 after;
+    if (get_written(sim, inst, &after)) {
+        write_char(&sim->out, ' ');
+        write_hex(&sim->out, before);
+        write_bytes(&sim->out, "->", 2);
+        write_hex(&sim->out, after);
+    }
+    write_bytes(&sim->out, " ip:", 4);
+    write_hex(&sim->out, inst->address);
+    write_bytes(&sim->out, "->", 2);
+    write_hex(&sim->out, sim->ip);
+    u16 flags_after = get_flags(sim);
+    if (flags_after != flags_before) {
+        write_bytes(&sim->out, " flags:", 7);
+        write_flag_letters(&sim->out, flags_before);
+        write_bytes(&sim->out, "->", 2);
+        write_flag_letters(&sim->out, flags_after);
     }
-    inst->operands[operand_num] = res;
 }
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
+#include <setjmp.h>
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -18,12 +19,25 @@ typedef int16_t i16;
 typedef int32_t i32;
 typedef int64_t i64;
 
+typedef double f64;
+
 #define len(arr) (sizeof(arr) / sizeof(arr[0]))
 
-#define BUFFER_SIZE (1024*1024)
+#define MEMORY_SIZE (1024*1024)
+#define MEMORY_GUARD_SIZE 4096
+#define MEMORY_PAGE_SIZE 4096
+#define MEMORY_PAGE_COUNT (MEMORY_SIZE / MEMORY_PAGE_SIZE)
+#define ICACHE_SIZE 4096        // must be a power of two
+#define MAX_INSTRUCTION_SIZE 6
+#define OUTPUT_BUFFER_SIZE (4*1024*1024)
+#define MAX_BLOCKS 4096
+#define MAX_BLOCK_UOPS 64
+#define BLOCK_MAP_SIZE 4096     // must be a power of two
+#define UOP_POOL_SIZE (MAX_BLOCKS * 16)
 
 typedef enum {
     FlagWide = (1 << 0),
+    FlagRep = (1 << 1),     // string op repeated cx times
 } FlagTypes;
 
 typedef enum {
@@ -32,6 +46,37 @@ typedef enum {
     OpAdd,
     OpSub,
     OpCmp,
+    OpXor,
+    OpTest,
+    OpInc,
+    OpDec,
+    OpShl,
+    OpShr,
+    OpAnd,
+    OpOr,
+    OpAdc,
+    OpSbb,
+    OpNot,
+    OpNeg,
+    OpSar,
+    OpRol,
+    OpRor,
+    OpRcl,
+    OpRcr,
+    OpMul,
+    OpImul,
+    OpDiv,
+    OpIdiv,
+    OpCbw,
+    OpCwd,
+    OpPush,
+    OpPop,
+    OpMovs,
+    OpStos,
+    OpLods,
+    OpCall,
+    OpJmp,
+    OpRet,
     OpJe,
     OpJl,
     OpJle,
@@ -119,17 +164,404 @@ typedef struct {
     u32 flags;              // flags
 } Instruction;
 
+typedef struct Sim8086 Sim8086;
+
+// runs one instruction; which one an instruction gets depends only on its op and width, so
+// it is picked once when the instruction is decoded (see select_executor)
+typedef void ExecuteFunction(Sim8086* sim, Instruction* inst);
+
+typedef struct {
+    bool valid;
+    Instruction inst;
+    ExecuteFunction *execute;
+} ICacheEntry;
+
+#define PACKED_KIND_MASK 0x07
+#define PACKED_SIGNED 0x80      // immediate was sign extended from a byte
+
+// an operand in 4 bytes: registers as index | offset << 4 | count << 5, memory as the
+// effective address base with a 16-bit displacement (see sim8086_packed.h)
+typedef struct {
+    u8 kind;            // OperandType, plus PACKED_SIGNED
+    u8 selector;
+    u16 value;          // immediate, relative immediate or displacement
+} PackedOperand;
+
+// an Instruction without its address in 12 bytes, for storing decoded streams in bulk
+typedef struct {
+    u8 op;
+    u8 size;
+    u8 flags;
+    u8 reserved;
+    PackedOperand operands[2];
+} PackedInstruction;
+
+#define NO_INSTRUCTION 0xffffffff
+
+// a decoded program image with one array per field, so a pass over the stream only touches
+// the fields it needs
+typedef struct {
+    u32 start;
+    u32 end;
+    u32 count;
+    u32 *address;
+    u8 *op;
+    u8 *size;
+    u8 *flags;
+    PackedOperand *operands[2];
+    u32 *index_at;      // index of the instruction at each address from start, or NO_INSTRUCTION
+} DecodedProgram;
+
+// execution profile of one instruction address
+typedef struct {
+    u64 hits;       // times executed
+    u64 clocks;     // clocks spent executing it
+    u64 taken;      // times a jump at this address was taken
+    Instruction inst;   // as first executed, since the program may overwrite its code
+} ProfileEntry;
+
+// pre-specialized operations a basic block is translated into; anything without a
+// specialized form falls back to the instruction's executor
 typedef enum {
-    Zero_flag = (1 << 0),
-    Sign_flag = (1 << 1),
-    Flag_count,
+    UopGeneric,
+    UopMovRegImm,
+    UopMovRegReg,
+    UopMovMemImm,
+    UopMovMemReg,
+    UopAddRegImm,
+    UopAddRegReg,
+    UopAddMemImm,
+    UopAddMemReg,
+    UopSubRegImm,
+    UopSubRegReg,
+    UopCmpRegImm,
+    UopCmpRegReg,
+} UopType;
+
+typedef struct {
+    u8 type;            // UopType
+    u8 dest;            // destination register
+    u8 src;             // source register
+    u8 ea_regs[2];      // registers summed into a memory address (Reg_none reads as 0)
+    i16 displacement;   // memory address displacement
+    u16 immediate;      // immediate source
+} Uop;
+
+typedef struct Block Block;
+
+// straight-line run of instructions ending at a jump, a size limit or the end of the image
+struct Block {
+    u32 start;          // address of first instruction
+    u32 end;            // address after the last instruction
+    u32 first_uop;      // index of first uop in the uop pool
+    u32 uop_count;      // number of uops (excludes the branch)
+    u32 inst_count;     // number of instructions (includes the branch)
+    u32 clocks;         // base and ea clocks for one pass, with the branch not taken
+    u32 taken_clocks;   // extra clocks when the branch is taken
+    u64 executions;     // passes through the block since it was translated
+    u64 clocks_spent;   // clocks of all those passes, including penalties and taken branches
+    bool has_branch;    // block ends with branch
+    Instruction branch; // terminating jump, loop, call or ret
+    ExecuteFunction *branch_execute;
+    Block *next[2];     // chained successors: [0] fall through, [1] branch taken
+};
+
+typedef enum {
+    Carry_flag = (1 << 0),
+    Parity_flag = (1 << 1),
+    Aux_carry_flag = (1 << 2),
+    Zero_flag = (1 << 3),
+    Sign_flag = (1 << 4),
+    Overflow_flag = (1 << 5),
 } Flag;
 
+// last flag setting operation; flags are computed from it on demand
 typedef struct {
-    OperandType dest;
-    OperandType src;
-    u32 clock;
-    bool add_ea;
+    OpType op;      // operation (OpNone before any flags are set)
+    u16 dest;       // destination value before the operation
+    u16 src;        // source value
+    u16 result;     // value produced
+    bool wide;      // 16-bit operation
+    bool carry;     // carry flag left by the previous operation, for inc, dec, adc and sbb
+    u16 flags;      // every flag, for ops that set them individually (rotates, mul, imul)
+} LazyFlags;
+
+typedef struct {
+    u32 count;
+    const char *data;
+} String;
+
+// accumulates formatted output in memory and writes it to file in large chunks
+typedef struct {
+    FILE *file;
+    char *data;
+    u32 count;
+    u32 capacity;
+} Writer;
+
+typedef struct OpcodeEntry OpcodeEntry;
+typedef void DecodeFunction(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+
+// describes how to decode an instruction from its first byte; the d/w/s bits and any
+// register encoded in the opcode byte are extracted once when the table is built
+struct OpcodeEntry {
+    OpType op;                  // opcode type (OpNone if chosen by the mod/reg/rm reg field)
+    DecodeFunction *decode;     // routine that decodes the remaining fields
+    const OpType *group;        // ops indexed by the mod/reg/rm reg field, for opcode groups
+    u8 d;                       // direction bit (1 => reg field is the destination); for shifts
+                                // the v bit (1 => shift count in cl)
+    u8 w;                       // wide bit (1 => 16-bit operands)
+    u8 s;                       // sign extend bit (1 => 8-bit immediate extended to 16 bits)
+    u8 reg;                     // register encoded in the opcode byte
+};
+
+// operand combinations that the 8086 manual gives separate timings for; shifts by 1 use the
+// immediate forms and shifts by cl the register source forms
+typedef enum {
+    FormNone,       // no operands, or a jump target
+    FormReg,
+    FormMem,
+    FormImm,        // ret imm16
+    FormRegReg,
+    FormRegMem,
+    FormMemReg,
+    FormRegImm,
+    FormMemImm,
+    FormAccImm,
+    FormAccMem,     // mov al/ax, [direct]
+    FormMemAcc,     // mov [direct], al/ax
+    FormCount,
+} OperandForm;
+
+typedef struct {
+    u8 clocks;      // base clocks, excluding effective address calculation
+    u8 transfers;   // memory transfers, each paying the bus penalty when it is a word
 } ClockEntry;
 
-#endif
\ No newline at end of file
+// clocks of one instruction, split the way the 8086 manual adds them up
+typedef struct {
+    u32 base;
+    u32 ea;         // effective address calculation
+    u32 penalty;    // word transfers on an odd address (8086) or over the 8-bit bus (8088)
+    u32 wait;       // clocks the EU waited for instruction bytes (prefetch queue model only)
+} Timing;
+
+// bus interface unit instruction prefetch; the queue holds the bytes just before fetch_address
+typedef struct {
+    u32 fetch_address;  // next byte the BIU will fetch
+    u32 count;          // bytes in the queue
+    u32 progress;       // clocks spent on the bus cycle currently fetching
+} PrefetchQueue;
+
+// translated blocks of one simulator instance (see sim8086_block.c)
+typedef struct {
+    Block blocks[MAX_BLOCKS];
+    u32 block_count;
+
+    // uops of every translated block, and the instruction each one was translated from
+    Uop uops[UOP_POOL_SIZE];
+    Instruction uop_insts[UOP_POOL_SIZE];
+    ExecuteFunction *uop_executors[UOP_POOL_SIZE];  // used by generic uops
+    u32 uop_count;
+
+    // translated blocks, direct mapped by start address
+    Block *map[BLOCK_MAP_SIZE];
+
+    // set when the program writes into its own image; every block is retranslated
+    bool stale;
+
+    u64 flush_count;
+    u64 clocks_total;
+    u64 blocks_translated;
+    u64 blocks_executed;
+    u64 blocks_chained;
+    u64 insts_executed;
+} BlockCache;
+
+#define TRACE_SNAPSHOT_INTERVAL 4096
+#define MAX_TRACE_WRITES 4
+
+// an execution trace (see sim8086_trace.c) is a TraceHeader, the program image, one record per
+// executed instruction, the TraceSnapshot table and a TraceFooter
+typedef struct {
+    char magic[4];              // "S86T"
+    u32 version;
+    u32 code_start;
+    u32 code_end;
+    u32 snapshot_interval;
+    u32 reserved;
+} TraceHeader;
+
+// machine state before the given step, and where that step's record starts in the file
+typedef struct {
+    u64 step;
+    u64 offset;
+    u16 reg_state[Reg_count];
+    u16 flags;
+    u32 ip;
+} TraceSnapshot;
+
+typedef struct {
+    u64 steps;
+    u64 snapshot_offset;
+    u32 snapshot_count;
+    char magic[4];              // "S86E"
+} TraceFooter;
+
+// a memory write of one step, with the bytes it overwrote and the bytes it left. a repeated
+// string op is a single write of every byte it stored
+typedef struct {
+    u32 address;
+    u32 size;
+    const u8 *old_data;         // in the mapped trace when replaying; unused while recording
+    const u8 *new_data;
+} TraceWrite;
+
+// one step of a trace as read back
+typedef struct {
+    u32 ip;                     // ip after the step
+    u16 changed;                // bit 0 for the flags, bit r for register r
+    u16 reg_state[Reg_count];   // registers listed in changed
+    u16 flags;
+    TraceWrite writes[MAX_TRACE_WRITES];
+    u32 write_count;
+} TraceRecord;
+
+typedef struct {
+    FILE *file;
+    Writer out;
+    u64 offset;                 // file offset of the next record
+    u64 steps;
+
+    // state as of the last record, which the next one is a delta against
+    u16 reg_state[Reg_count];
+    u16 flags;
+
+    TraceWrite writes[MAX_TRACE_WRITES];
+    u32 write_count;
+    u8 *old_data;               // bytes overwritten by this step's writes, one after the other
+    u32 old_data_size;
+    u32 old_data_capacity;
+
+    TraceSnapshot *snapshots;
+    u32 snapshot_count;
+    u32 snapshot_capacity;
+} Tracer;
+
+// a mapped trace file and the machine state reconstructed from it
+typedef struct {
+    const u8 *data;
+    u64 size;
+    const TraceHeader *header;
+    const TraceFooter *footer;
+    const TraceSnapshot *snapshots;
+
+    // memory is only moved by applying or undoing writes, so it is kept as of memory_step,
+    // whose record starts at memory_offset
+    u8 *memory;
+    u64 memory_step;
+    u64 memory_offset;
+
+    u16 reg_state[Reg_count];
+    u16 flags;
+    u32 ip;
+
+    TraceRecord *records;       // the steps of one snapshot interval, for undoing writes
+} Replay;
+
+// everything one simulated machine and its run touch, so independent instances can run side by
+// side on different threads. options parsed from the command line stay global and read only
+struct Sim8086 {
+    u16 reg_state[Reg_count];
+    LazyFlags lazy_flags;
+    u32 ip;
+    bool halted;
+    u32 call_depth;             // calls not yet returned from; a ret at depth 0 ends the program
+
+    // simulated address space; program images are mapped straight into it at the load address
+    u8 *memory;
+    u32 code_start;
+    u32 code_end;
+
+    // pages written since the program was loaded, including the ones it was loaded into
+    bool dirty_pages[MEMORY_PAGE_COUNT];
+
+    // decoded instructions, direct mapped by ip
+    ICacheEntry icache[ICACHE_SIZE];
+    u64 icache_hits;
+    u64 icache_misses;
+
+    PrefetchQueue queue;
+
+    // per address totals over the program image, indexed by ip - code_start (-profile)
+    ProfileEntry *profile;
+    u64 profile_clocks;
+    ProfileEntry profile_outside;   // totals for instructions executed outside the image
+
+    BlockCache *block_cache;    // allocated by the first -blocks run
+
+    const char *trace_path;     // where to record the run, if anywhere (-trace)
+    Tracer *trace;
+
+    // where to write memory at the end of the run, if anywhere (-dump, -dump-image)
+    const char *dump_path;
+    const char *image_path;
+
+    // buffered output for disassembly, traces and reports
+    Writer out;
+};
+
+typedef struct {
+    char *filename;
+    u32 load_address;
+} BatchFile;
+
+// files of a -jobs run, shared by the worker threads; each worker claims the next file by
+// atomically incrementing next
+typedef struct {
+    BatchFile *files;
+    u32 file_count;
+    u32 next;
+    u32 failures;
+    const char *outdir;
+} BatchQueue;
+
+// one speculative linear sweep through a chunk from a single start offset (see sim8086_sweep.c)
+typedef struct {
+    u32 first;          // index of its first instruction in the chunk's pool
+    u32 count;          // instructions it decoded itself
+    u32 exit;           // address after its last instruction
+    bool merged;        // exit was already decoded by an earlier path, which it continues along
+    bool failed;        // exit is an invalid instruction or one that runs past the image
+} SweepPath;
+
+typedef struct {
+    u32 start;
+    u32 end;
+
+    // instructions of every path, and the pool index of the one at each address from start
+    Instruction *pool;
+    u32 pool_count;
+    u32 *index_at;
+
+    // one path for each offset the real stream may enter at, since the last instruction of
+    // the previous chunk can run up to MAX_INSTRUCTION_SIZE - 1 bytes into this one
+    SweepPath paths[MAX_INSTRUCTION_SIZE];
+    u32 path_count;
+
+    // filled in when the chunks are stitched together
+    u32 entry;
+    u32 output;         // index of its first instruction in the stitched stream
+    u32 count;
+} SweepChunk;
+
+typedef struct {
+    const u8 *buffer;
+    u32 end;
+    SweepChunk *chunks;
+    u32 chunk_count;
+    u32 next;           // next chunk for a worker to claim
+    Instruction *insts;
+} Sweep;
+
+#endif
@@ -0,0 +1,334 @@
+#include "sim8086.h"
+#include "sim8086_decode.h"
+#include "sim8086_print.h"
+#include "sim8086_clock.h"
+#include "sim8086_exec.h"
+#include "sim8086_block.h"
+#include "sim8086_timing.h"
+
+static void flush_blocks(BlockCache* cache) {
+    cache->block_count = 0;
+    cache->uop_count = 0;
+    memset(cache->map, 0, sizeof(cache->map));
+    cache->stale = false;
+    cache->flush_count++;
+}
+
+void invalidate_blocks(Sim8086* sim) {
+    if (sim->block_cache) {
+        sim->block_cache->stale = true;
+    }
+}
+
+static void set_effective_address(Uop* uop, EffectiveAddress* address) {
+    static const u8 ea_regs[][2] = {
+            [Ea_direct] = { Reg_none, Reg_none },
+            [Ea_bx_si] = { Reg_b, Reg_si },
+            [Ea_bx_di] = { Reg_b, Reg_di },
+            [Ea_bp_si] = { Reg_bp, Reg_si },
+            [Ea_bp_di] = { Reg_bp, Reg_di },
+            [Ea_si] = { Reg_si, Reg_none },
+            [Ea_di] = { Reg_di, Reg_none },
+            [Ea_bp] = { Reg_bp, Reg_none },
+            [Ea_bx] = { Reg_b, Reg_none },
+    };
+    uop->ea_regs[0] = ea_regs[address->base][0];
+    uop->ea_regs[1] = ea_regs[address->base][1];
+    uop->displacement = (i16)address->displacement;
+}
+
+// picks the specialized uop for an instruction; only 16-bit forms with a register or
+// immediate source are specialized, everything else runs through the executor picked for it
+static Uop translate_uop(Instruction* inst) {
+    Uop uop = { UopGeneric };
+    Operand *dest = &inst->operands[0];
+    Operand *src = &inst->operands[1];
+    if (!(inst->flags & FlagWide) || (src->kind != OperandRegister && src->kind != OperandImmediate)) {
+        return uop;
+    }
+
+    bool reg_src = src->kind == OperandRegister;
+    if (dest->kind == OperandRegister) {
+        switch (inst->op) {
+            case OpMov: uop.type = reg_src ? UopMovRegReg : UopMovRegImm; break;
+            case OpAdd: uop.type = reg_src ? UopAddRegReg : UopAddRegImm; break;
+            case OpSub: uop.type = reg_src ? UopSubRegReg : UopSubRegImm; break;
+            case OpCmp: uop.type = reg_src ? UopCmpRegReg : UopCmpRegImm; break;
+            default: return uop;
+        }
+        uop.dest = dest->reg.index;
+    } else if (dest->kind == OperandMemory) {
+        switch (inst->op) {
+            case OpMov: uop.type = reg_src ? UopMovMemReg : UopMovMemImm; break;
+            case OpAdd: uop.type = reg_src ? UopAddMemReg : UopAddMemImm; break;
+            default: return uop;
+        }
+        set_effective_address(&uop, &dest->address);
+    }
+
+    if (reg_src) {
+        uop.src = src->reg.index;
+    } else {
+        uop.immediate = (u16)src->immediate;
+    }
+    return uop;
+}
+
+static Block* translate_block(Sim8086* sim, u32 start) {
+    BlockCache *cache = sim->block_cache;
+    if (cache->block_count == MAX_BLOCKS || cache->uop_count + MAX_BLOCK_UOPS > UOP_POOL_SIZE) {
+        flush_blocks(cache);
+    }
+
+    Block *block = &cache->blocks[cache->block_count++];
+    block->start = start;
+    block->first_uop = cache->uop_count;
+    block->uop_count = 0;
+    block->inst_count = 0;
+    block->clocks = 0;
+    block->taken_clocks = 0;
+    block->executions = 0;
+    block->clocks_spent = 0;
+    block->has_branch = false;
+    block->next[0] = NULL;
+    block->next[1] = NULL;
+
+    u32 address = start;
+    while (address < sim->code_end && block->uop_count < MAX_BLOCK_UOPS) {
+        Instruction inst = decode(sim->memory, address);
+        address += inst.size;
+        if (address > sim->code_end) {
+            fatal("instruction exceeds disassembly region.");
+        }
+        block->inst_count++;
+        block->clocks += get_static_clocks(&inst);
+        if (is_branch(inst.op)) {
+            block->branch = inst;
+            block->branch_execute = select_executor(&inst);
+            block->has_branch = true;
+            block->taken_clocks = get_taken_clocks(inst.op);
+            break;
+        }
+        cache->uop_insts[cache->uop_count] = inst;
+        cache->uop_executors[cache->uop_count] = select_executor(&inst);
+        cache->uops[cache->uop_count] = translate_uop(&inst);
+        cache->uop_count++;
+        block->uop_count++;
+    }
+    block->end = address;
+
+    cache->map[start & (BLOCK_MAP_SIZE - 1)] = block;
+    cache->blocks_translated++;
+    return block;
+}
+
+static Block* get_block(Sim8086* sim, u32 start) {
+    Block *block = sim->block_cache->map[start & (BLOCK_MAP_SIZE - 1)];
+    if (!block || block->start != start) {
+        block = translate_block(sim, start);
+    }
+    return block;
+}
+
+static inline u16 uop_address(Sim8086* sim, Uop* uop) {
+    return sim->reg_state[uop->ea_regs[0]] + sim->reg_state[uop->ea_regs[1]] + uop->displacement;
+}
+
+// runs the uops of a block; returns false if one of them wrote into the program image,
+// leaving ip at the instruction after the write so translation can restart from there
+static bool execute_uops(Sim8086* sim, Block* block) {
+    BlockCache *cache = sim->block_cache;
+    Uop *uop = &cache->uops[block->first_uop];
+    Uop *end = uop + block->uop_count;
+    for (; uop < end; uop++) {
+        switch (uop->type) {
+            case UopMovRegImm:
+                sim->reg_state[uop->dest] = uop->immediate;
+                continue;
+            case UopMovRegReg:
+                sim->reg_state[uop->dest] = sim->reg_state[uop->src];
+                continue;
+            case UopAddRegImm: {
+                u16 dest = sim->reg_state[uop->dest];
+                sim->reg_state[uop->dest] = dest + uop->immediate;
+                record_flags(sim, OpAdd, dest, uop->immediate, sim->reg_state[uop->dest], true);
+            } continue;
+            case UopAddRegReg: {
+                u16 dest = sim->reg_state[uop->dest];
+                u16 src = sim->reg_state[uop->src];
+                sim->reg_state[uop->dest] = dest + src;
+                record_flags(sim, OpAdd, dest, src, sim->reg_state[uop->dest], true);
+            } continue;
+            case UopSubRegImm: {
+                u16 dest = sim->reg_state[uop->dest];
+                sim->reg_state[uop->dest] = dest - uop->immediate;
+                record_flags(sim, OpSub, dest, uop->immediate, sim->reg_state[uop->dest], true);
+            } continue;
+            case UopSubRegReg: {
+                u16 dest = sim->reg_state[uop->dest];
+                u16 src = sim->reg_state[uop->src];
+                sim->reg_state[uop->dest] = dest - src;
+                record_flags(sim, OpSub, dest, src, sim->reg_state[uop->dest], true);
+            } continue;
+            case UopCmpRegImm: {
+                u16 dest = sim->reg_state[uop->dest];
+                record_flags(sim, OpCmp, dest, uop->immediate, dest - uop->immediate, true);
+            } continue;
+            case UopCmpRegReg: {
+                u16 dest = sim->reg_state[uop->dest];
+                u16 src = sim->reg_state[uop->src];
+                record_flags(sim, OpCmp, dest, src, dest - src, true);
+            } continue;
+            case UopMovMemImm: {
+                u16 address = uop_address(sim, uop);
+                cache->clocks_total += get_transfer_penalty(address, 1);
+                code_written(sim, address, sizeof(u16));
+                *(u16*)&sim->memory[address] = uop->immediate;
+            } break;
+            case UopMovMemReg: {
+                u16 address = uop_address(sim, uop);
+                cache->clocks_total += get_transfer_penalty(address, 1);
+                code_written(sim, address, sizeof(u16));
+                *(u16*)&sim->memory[address] = sim->reg_state[uop->src];
+            } break;
+            case UopAddMemImm: {
+                u16 address = uop_address(sim, uop);
+                cache->clocks_total += get_transfer_penalty(address, 2);
+                u16 dest = *(u16*)&sim->memory[address];
+                code_written(sim, address, sizeof(u16));
+                *(u16*)&sim->memory[address] = dest + uop->immediate;
+                record_flags(sim, OpAdd, dest, uop->immediate, dest + uop->immediate, true);
+            } break;
+            case UopAddMemReg: {
+                u16 address = uop_address(sim, uop);
+                cache->clocks_total += get_transfer_penalty(address, 2);
+                u16 dest = *(u16*)&sim->memory[address];
+                u16 src = sim->reg_state[uop->src];
+                code_written(sim, address, sizeof(u16));
+                *(u16*)&sim->memory[address] = dest + src;
+                record_flags(sim, OpAdd, dest, src, dest + src, true);
+            } break;
+            default: {
+                Instruction *inst = &cache->uop_insts[uop - cache->uops];
+                cache->clocks_total += get_dynamic_clocks(sim, inst);
+                cache->uop_executors[uop - cache->uops](sim, inst);
+            } break;
+        }
+
+        // only reached by uops that may write memory
+        if (cache->stale) {
+            for (Instruction *inst = &cache->uop_insts[block->first_uop]; inst <= &cache->uop_insts[uop - cache->uops]; inst++) {
+                cache->insts_executed++;
+                cache->clocks_total += get_static_clocks(inst);
+                sim->ip = inst->address + inst->size;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+static int compare_clocks_spent(const void* a, const void* b) {
+    u64 spent_a = (*(Block**)a)->clocks_spent;
+    u64 spent_b = (*(Block**)b)->clocks_spent;
+    return spent_a < spent_b ? 1 : spent_a > spent_b ? -1 : 0;
+}
+
+// lists the blocks still in the pool by the clocks spent in them, most expensive first
+static void print_block_clocks(Sim8086* sim) {
+    BlockCache *cache = sim->block_cache;
+    Block **sorted = malloc(cache->block_count * sizeof(Block*));
+    for (u32 i = 0; i < cache->block_count; i++) {
+        sorted[i] = &cache->blocks[i];
+    }
+    qsort(sorted, cache->block_count, sizeof(Block*), compare_clocks_spent);
+
+    u32 count = cache->block_count < 10 ? cache->block_count : 10;
+    for (u32 i = 0; i < count; i++) {
+        Block *block = sorted[i];
+        write_format(&sim->out, "%8s0x%04x-0x%04x: %lu clocks over %lu runs (%u per run, branch not taken)\n", "",
+                     block->start, block->end, block->clocks_spent, block->executions, block->clocks);
+    }
+    free(sorted);
+}
+
+void run_blocks(Sim8086* sim) {
+    if (!sim->block_cache) {
+        sim->block_cache = malloc(sizeof(BlockCache));
+        if (!sim->block_cache) {
+            fatal("unable to allocate block cache");
+        }
+        sim->block_cache->flush_count = 0;
+    }
+    BlockCache *cache = sim->block_cache;
+    flush_blocks(cache);
+    cache->blocks_translated = 0;
+    cache->blocks_executed = 0;
+    cache->blocks_chained = 0;
+    cache->insts_executed = 0;
+    cache->clocks_total = 0;
+
+    u64 start = read_cpu_timer();
+    Block *block = sim->ip < sim->code_end ? get_block(sim, sim->ip) : NULL;
+    while (block) {
+        cache->blocks_executed++;
+        u64 clocks_before = cache->clocks_total;
+        if (!execute_uops(sim, block)) {
+            flush_blocks(cache);
+            block = sim->ip < sim->code_end ? get_block(sim, sim->ip) : NULL;
+            continue;
+        }
+        cache->insts_executed += block->inst_count;
+        cache->clocks_total += block->clocks;
+
+        // the terminator (a jump, loop, call or ret) runs last; it only moves ip when taken.
+        // conditional jumps have no dynamic clocks, only the extra cost of being taken
+        sim->ip = block->end;
+        if (block->has_branch) {
+            u32 dynamic_clocks = get_dynamic_clocks(sim, &block->branch);
+            cache->clocks_total += dynamic_clocks;
+            block->branch_execute(sim, &block->branch);
+            if (sim->halted) {
+                // a ret out of the program stops it rather than running, so it is neither
+                // counted nor timed
+                cache->insts_executed--;
+                cache->clocks_total -= get_static_clocks(&block->branch) + dynamic_clocks;
+            }
+        }
+        u32 taken = sim->ip != block->end;
+        if (taken) {
+            cache->clocks_total += block->taken_clocks;
+        }
+        block->executions++;
+        block->clocks_spent += cache->clocks_total - clocks_before;
+        if (sim->halted || sim->ip >= sim->code_end) {
+            break;
+        }
+        if (cache->stale) {
+            // the terminator wrote into the image, e.g. a call pushing onto a stack inside it
+            flush_blocks(cache);
+            block = get_block(sim, sim->ip);
+            continue;
+        }
+
+        Block *next = block->next[taken];
+        if (next && next->start == sim->ip) {
+            cache->blocks_chained++;
+        } else {
+            // translating may flush the pool, which also discards the current block
+            u64 flushes = cache->flush_count;
+            next = get_block(sim, sim->ip);
+            if (cache->flush_count == flushes) block->next[taken] = next;
+        }
+        block = next;
+    }
+    u64 elapsed = read_cpu_timer() - start;
+
+    print_run_summary(sim, cache->insts_executed, cache->clocks_total, elapsed);
+    if (stats) {
+        write_char(&sim->out, '\n');
+        write_format(&sim->out, "Blocks: %lu translated, %lu executed, %lu chained\n",
+                     cache->blocks_translated, cache->blocks_executed, cache->blocks_chained);
+        print_block_clocks(sim);
+    }
+}
@@ -0,0 +1,7 @@
+#ifndef PERF_AWARE_SIM8086_BLOCK_H
+#define PERF_AWARE_SIM8086_BLOCK_H
+
+void run_blocks(Sim8086* sim);
+void invalidate_blocks(Sim8086* sim);
+
+#endif
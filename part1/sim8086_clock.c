@@ -0,0 +1,50 @@
+#include "sim8086.h"
+#include "sim8086_clock.h"
+
+#include <x86intrin.h>
+#include <sys/time.h>
+
+// returns number of microseconds in a second
+u64 get_os_time_freq(void) {
+    return 1000000;
+}
+
+// returns current unix timestamp in microseconds
+u64 read_os_timer(void) {
+    struct timeval value;
+    gettimeofday(&value, 0);
+    u64 result = get_os_time_freq()*(u64)value.tv_sec + (u64)value.tv_usec;
+    return result;
+}
+
+u64 read_cpu_timer(void) {
+    return __rdtsc();
+}
+
+// determine the number of CPU cycle counts per second by counting
+// the number of CPU cycles that happen in 100 milliseconds of OS time
+u64 estimate_cpu_timer_freq(void) {
+    u64 milliseconds_to_wait = 100;
+    u64 os_freq = get_os_time_freq();
+
+    u64 cpu_start = read_cpu_timer();
+    u64 os_start = read_os_timer();
+    u64 os_end = 0;
+    u64 os_elapsed = 0;
+    u64 os_wait_time = os_freq * milliseconds_to_wait / 1000;
+
+    while (os_elapsed < os_wait_time) {
+        os_end = read_os_timer();
+        os_elapsed = os_end - os_start;
+    }
+
+    u64 cpu_end = read_cpu_timer();
+    u64 cpu_elapsed = cpu_end - cpu_start;
+
+    u64 cpu_freq = 0;
+    if (os_elapsed) {
+        cpu_freq = os_freq * cpu_elapsed / os_elapsed;
+    }
+
+    return cpu_freq;
+}
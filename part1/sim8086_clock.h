@@ -0,0 +1,9 @@
+#ifndef PERF_AWARE_SIM8086_CLOCK_H
+#define PERF_AWARE_SIM8086_CLOCK_H
+
+u64 get_os_time_freq(void);
+u64 read_os_timer(void);
+u64 read_cpu_timer(void);
+u64 estimate_cpu_timer_freq(void);
+
+#endif
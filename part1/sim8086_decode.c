@@ -0,0 +1,817 @@
+#include "sim8086.h"
+#include "sim8086_decode.h"
+#include "sim8086_print.h"
+
+void decode_rm_reg(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_im_to_reg(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_im_to_rm(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_acc_mem(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_im_to_acc(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_jmp(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_reg(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_rm(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_shift(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_none(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_jmp_near(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_im16(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_string(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void decode_rep(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry);
+void set_reg_operand(Instruction* inst, u8 reg, u8 wide, u8 operand_num);
+void set_effective_address_operand(Instruction* inst, const u8 buffer[], u8 wide, u8 rm, u8 mod, u8 operand_num);
+void set_immediate_operand(Instruction* inst, const u8 buffer[], u8 sign, u8 wide, u8 operand_num);
+
+// ==================================== Opcode Groups =================================== //
+
+// ops selected by the reg field of the mod/reg/rm byte; OpNone marks encodings not supported
+
+// immediate to register/memory (0x80-0x83)
+static const OpType im_to_rm_ops[8] = {
+    [0b000] = OpAdd,
+    [0b001] = OpOr,
+    [0b010] = OpAdc,
+    [0b011] = OpSbb,
+    [0b100] = OpAnd,
+    [0b101] = OpSub,
+    [0b110] = OpXor,
+    [0b111] = OpCmp,
+};
+
+// shifts and rotates (0xd0-0xd3)
+static const OpType shift_ops[8] = {
+    [0b000] = OpRol,
+    [0b001] = OpRor,
+    [0b010] = OpRcl,
+    [0b011] = OpRcr,
+    [0b100] = OpShl,
+    [0b101] = OpShr,
+    [0b111] = OpSar,
+};
+
+// byte/word register/memory (0xf6, 0xf7)
+static const OpType f6_ops[8] = {
+    [0b000] = OpTest,
+    [0b010] = OpNot,
+    [0b011] = OpNeg,
+    [0b100] = OpMul,
+    [0b101] = OpImul,
+    [0b110] = OpDiv,
+    [0b111] = OpIdiv,
+};
+
+// increment/decrement byte register/memory (0xfe)
+static const OpType fe_ops[8] = {
+    [0b000] = OpInc,
+    [0b001] = OpDec,
+};
+
+// word register/memory (0xff); far calls and jumps need segments, which are not simulated
+static const OpType ff_ops[8] = {
+    [0b000] = OpInc,
+    [0b001] = OpDec,
+    [0b010] = OpCall,
+    [0b100] = OpJmp,
+    [0b110] = OpPush,
+};
+
+// pop register/memory (0x8f)
+static const OpType pop_ops[8] = {
+    [0b000] = OpPop,
+};
+
+// ==================================== Opcode Table ==================================== //
+
+// [opcode | d | w] [mod | reg | r/m] [disp-lo] [disp-hi]
+#define RM_REG(byte, op) \
+    [(byte) + 0] = { op, decode_rm_reg, NULL, 0, 0, 0, 0 }, \
+    [(byte) + 1] = { op, decode_rm_reg, NULL, 0, 1, 0, 0 }, \
+    [(byte) + 2] = { op, decode_rm_reg, NULL, 1, 0, 0, 0 }, \
+    [(byte) + 3] = { op, decode_rm_reg, NULL, 1, 1, 0, 0 }
+
+// [opcode | w] [data] [data if w]
+#define IM_TO_ACC(byte, op) \
+    [(byte) + 0] = { op, decode_im_to_acc, NULL, 0, 0, 0, 0 }, \
+    [(byte) + 1] = { op, decode_im_to_acc, NULL, 0, 1, 0, 0 }
+
+// [opcode | s | w] [mod | op | r/m] [disp-lo] [disp-hi] [data] [data if s:w == 01]
+#define IM_TO_RM(byte, group) \
+    [(byte) + 0] = { OpNone, decode_im_to_rm, group, 0, 0, 0, 0 }, \
+    [(byte) + 1] = { OpNone, decode_im_to_rm, group, 0, 1, 0, 0 }, \
+    [(byte) + 2] = { OpNone, decode_im_to_rm, group, 0, 0, 1, 0 }, \
+    [(byte) + 3] = { OpNone, decode_im_to_rm, group, 0, 1, 1, 0 }
+
+// [opcode | w | reg] [data] [data if w]
+#define IM_TO_REG(byte, w) \
+    [(byte) + 0] = { OpMov, decode_im_to_reg, NULL, 0, w, 0, 0 }, \
+    [(byte) + 1] = { OpMov, decode_im_to_reg, NULL, 0, w, 0, 1 }, \
+    [(byte) + 2] = { OpMov, decode_im_to_reg, NULL, 0, w, 0, 2 }, \
+    [(byte) + 3] = { OpMov, decode_im_to_reg, NULL, 0, w, 0, 3 }, \
+    [(byte) + 4] = { OpMov, decode_im_to_reg, NULL, 0, w, 0, 4 }, \
+    [(byte) + 5] = { OpMov, decode_im_to_reg, NULL, 0, w, 0, 5 }, \
+    [(byte) + 6] = { OpMov, decode_im_to_reg, NULL, 0, w, 0, 6 }, \
+    [(byte) + 7] = { OpMov, decode_im_to_reg, NULL, 0, w, 0, 7 }
+
+// [opcode | reg]
+#define REG(byte, op) \
+    [(byte) + 0] = { op, decode_reg, NULL, 0, 1, 0, 0 }, \
+    [(byte) + 1] = { op, decode_reg, NULL, 0, 1, 0, 1 }, \
+    [(byte) + 2] = { op, decode_reg, NULL, 0, 1, 0, 2 }, \
+    [(byte) + 3] = { op, decode_reg, NULL, 0, 1, 0, 3 }, \
+    [(byte) + 4] = { op, decode_reg, NULL, 0, 1, 0, 4 }, \
+    [(byte) + 5] = { op, decode_reg, NULL, 0, 1, 0, 5 }, \
+    [(byte) + 6] = { op, decode_reg, NULL, 0, 1, 0, 6 }, \
+    [(byte) + 7] = { op, decode_reg, NULL, 0, 1, 0, 7 }
+
+// [opcode | w] [mod | op | r/m] [disp-lo] [disp-hi]
+#define RM(byte, group) \
+    [(byte) + 0] = { OpNone, decode_rm, group, 0, 0, 0, 0 }, \
+    [(byte) + 1] = { OpNone, decode_rm, group, 0, 1, 0, 0 }
+
+// [opcode | v | w] [mod | op | r/m] [disp-lo] [disp-hi]
+#define SHIFT(byte, group) \
+    [(byte) + 0] = { OpNone, decode_shift, group, 0, 0, 0, 0 }, \
+    [(byte) + 1] = { OpNone, decode_shift, group, 0, 1, 0, 0 }, \
+    [(byte) + 2] = { OpNone, decode_shift, group, 1, 0, 0, 0 }, \
+    [(byte) + 3] = { OpNone, decode_shift, group, 1, 1, 0, 0 }
+
+// [opcode] [ip-inc8]
+#define JMP(byte, op) \
+    [byte] = { op, decode_jmp, NULL, 0, 0, 0, 0 }
+
+// [opcode | w]
+#define STRING(byte, op) \
+    [(byte) + 0] = { op, decode_string, NULL, 0, 0, 0, 0 }, \
+    [(byte) + 1] = { op, decode_string, NULL, 0, 1, 0, 0 }
+
+// indexed by the first byte of an instruction; bytes without a decode routine are unknown opcodes
+static const OpcodeEntry opcode_table[256] = {
+    RM_REG(0x00, OpAdd),
+    IM_TO_ACC(0x04, OpAdd),
+    RM_REG(0x08, OpOr),
+    IM_TO_ACC(0x0c, OpOr),
+    RM_REG(0x10, OpAdc),
+    IM_TO_ACC(0x14, OpAdc),
+    RM_REG(0x18, OpSbb),
+    IM_TO_ACC(0x1c, OpSbb),
+    RM_REG(0x20, OpAnd),
+    IM_TO_ACC(0x24, OpAnd),
+    RM_REG(0x28, OpSub),
+    IM_TO_ACC(0x2c, OpSub),
+    RM_REG(0x30, OpXor),
+    IM_TO_ACC(0x34, OpXor),
+    RM_REG(0x38, OpCmp),
+    IM_TO_ACC(0x3c, OpCmp),
+
+    REG(0x40, OpInc),
+    REG(0x48, OpDec),
+    REG(0x50, OpPush),
+    REG(0x58, OpPop),
+
+    JMP(0x70, OpJo),
+    JMP(0x71, OpJno),
+    JMP(0x72, OpJb),
+    JMP(0x73, OpJnb),
+    JMP(0x74, OpJe),
+    JMP(0x75, OpJne),
+    JMP(0x76, OpJbe),
+    JMP(0x77, OpJnbe),
+    JMP(0x78, OpJs),
+    JMP(0x79, OpJns),
+    JMP(0x7a, OpJp),
+    JMP(0x7b, OpJnp),
+    JMP(0x7c, OpJl),
+    JMP(0x7d, OpJnl),
+    JMP(0x7e, OpJle),
+    JMP(0x7f, OpJnle),
+
+    IM_TO_RM(0x80, im_to_rm_ops),
+
+    // test has no d bit; operands are always register/memory then register
+    [0x84] = { OpTest, decode_rm_reg, NULL, 0, 0, 0, 0 },
+    [0x85] = { OpTest, decode_rm_reg, NULL, 0, 1, 0, 0 },
+
+    RM_REG(0x88, OpMov),
+
+    [0x8f] = { OpNone, decode_rm, pop_ops, 0, 1, 0, 0 },
+
+    [0x98] = { OpCbw, decode_none, NULL, 0, 0, 0, 0 },
+    [0x99] = { OpCwd, decode_none, NULL, 0, 0, 0, 0 },
+
+    // accumulator/memory: d is set when the accumulator is the source
+    [0xa0] = { OpMov, decode_acc_mem, NULL, 0, 0, 0, 0 },
+    [0xa1] = { OpMov, decode_acc_mem, NULL, 0, 1, 0, 0 },
+    [0xa2] = { OpMov, decode_acc_mem, NULL, 1, 0, 0, 0 },
+    [0xa3] = { OpMov, decode_acc_mem, NULL, 1, 1, 0, 0 },
+
+    STRING(0xa4, OpMovs),
+    IM_TO_ACC(0xa8, OpTest),
+    STRING(0xaa, OpStos),
+    STRING(0xac, OpLods),
+
+    IM_TO_REG(0xb0, 0),
+    IM_TO_REG(0xb8, 1),
+
+    [0xc2] = { OpRet, decode_im16, NULL, 0, 0, 0, 0 },
+    [0xc3] = { OpRet, decode_none, NULL, 0, 0, 0, 0 },
+
+    [0xc6] = { OpMov, decode_im_to_rm, NULL, 0, 0, 0, 0 },
+    [0xc7] = { OpMov, decode_im_to_rm, NULL, 0, 1, 0, 0 },
+
+    SHIFT(0xd0, shift_ops),
+
+    JMP(0xe0, OpLoopnz),
+    JMP(0xe1, OpLoopz),
+    JMP(0xe2, OpLoop),
+    JMP(0xe3, OpJcxz),
+
+    [0xe8] = { OpCall, decode_jmp_near, NULL, 0, 0, 0, 0 },
+    [0xe9] = { OpJmp, decode_jmp_near, NULL, 0, 0, 0, 0 },
+    JMP(0xeb, OpJmp),
+
+    // repne and rep/repe; the string ops supported after them ignore the difference
+    [0xf2] = { OpNone, decode_rep, NULL, 0, 0, 0, 0 },
+    [0xf3] = { OpNone, decode_rep, NULL, 0, 0, 0, 0 },
+
+    RM(0xf6, f6_ops),
+    [0xfe] = { OpNone, decode_rm, fe_ops, 0, 0, 0, 0 },
+    [0xff] = { OpNone, decode_rm, ff_ops, 0, 1, 0, 0 },
+};
+
+// ====================================== Decoders ====================================== //
+
+// decodes without stopping on an invalid encoding, for callers that may be looking at data or
+// the middle of an instruction. returns false if the bytes at address are not a known instruction
+bool try_decode(const u8 buffer[], u32 address, Instruction* inst) {
+    inst->address = address;
+    inst->flags = 0;
+
+    const OpcodeEntry *entry = &opcode_table[buffer[address]];
+    if (!entry->decode) {
+        return false;
+    }
+
+    inst->op = entry->op;
+    entry->decode(inst, buffer, entry);
+    return inst->op != OpNone;
+}
+
+Instruction decode(const u8 buffer[], u32 address) {
+    Instruction inst;
+    if (!try_decode(buffer, address, &inst)) {
+        if (!opcode_table[buffer[address]].decode) {
+            fatal("unknown opcode encountered.");
+        }
+        fatal("unsupported opcode extension encountered.");
+    }
+    return inst;
+}
+
+bool operands_equal(Operand* a, Operand* b) {
+    if (a->kind != b->kind) return false;
+    switch (a->kind) {
+        case OperandRegister:
+            return a->reg.index == b->reg.index && a->reg.offset == b->reg.offset && a->reg.count == b->reg.count;
+        case OperandMemory:
+            return a->address.base == b->address.base && a->address.displacement == b->address.displacement;
+        case OperandImmediate:
+        case OperandRelativeImmediate:
+            return a->immediate == b->immediate;
+        default:
+            return true;
+    }
+}
+
+bool instructions_equal(Instruction* a, Instruction* b) {
+    return a->address == b->address && a->size == b->size && a->op == b->op && a->flags == b->flags &&
+           operands_equal(&a->operands[0], &b->operands[0]) && operands_equal(&a->operands[1], &b->operands[1]);
+}
+
+// switch-based reference decoder; kept so the table decoder can be benchmarked
+// and cross-checked against it
+Instruction decode_legacy(const u8 buffer[], u32 address) {
+    Instruction inst;
+    inst.address = address;
+    inst.op = OpNone;
+    inst.flags = 0;
+
+    u8 opcode = buffer[inst.address];
+    OpcodeEntry entry = { OpNone, NULL, NULL, (opcode >> 1) & 1, opcode & 1, (opcode >> 1) & 1, 0 };
+
+    // check for jump opcodes
+    switch (opcode) {
+        case 0b01110100:
+            inst.op = OpJe;
+            break;
+        case 0b01111100:
+            inst.op = OpJl;
+            break;
+        case 0b01111110:
+            inst.op = OpJle;
+            break;
+        case 0b01110010:
+            inst.op = OpJb;
+            break;
+        case 0b01110110:
+            inst.op = OpJbe;
+            break;
+        case 0b01111010:
+            inst.op = OpJp;
+            break;
+        case 0b01110000:
+            inst.op = OpJo;
+            break;
+        case 0b01111000:
+            inst.op = OpJs;
+            break;
+        case 0b01110101:
+            inst.op = OpJne;
+            break;
+        case 0b01111101:
+            inst.op = OpJnl;
+            break;
+        case 0b01111111:
+            inst.op = OpJnle;
+            break;
+        case 0b01110011:
+            inst.op = OpJnb;
+            break;
+        case 0b01110111:
+            inst.op = OpJnbe;
+            break;
+        case 0b01111011:
+            inst.op = OpJnp;
+            break;
+        case 0b01110001:
+            inst.op = OpJno;
+            break;
+        case 0b01111001:
+            inst.op = OpJns;
+            break;
+        case 0b11100010:
+            inst.op = OpLoop;
+            break;
+        case 0b11100001:
+            inst.op = OpLoopz;
+            break;
+        case 0b11100000:
+            inst.op = OpLoopnz;
+            break;
+        case 0b11100011:
+            inst.op = OpJcxz;
+            break;
+        case 0b11101011:
+            inst.op = OpJmp;
+            break;
+        case 0b11000011:
+            inst.op = OpRet;
+            decode_none(&inst, buffer, &entry);
+            return inst;
+        case 0b11000010:
+            inst.op = OpRet;
+            decode_im16(&inst, buffer, &entry);
+            return inst;
+        case 0b11101000:
+            inst.op = OpCall;
+            decode_jmp_near(&inst, buffer, &entry);
+            return inst;
+        case 0b11101001:
+            inst.op = OpJmp;
+            decode_jmp_near(&inst, buffer, &entry);
+            return inst;
+        case 0b10011000:
+            inst.op = OpCbw;
+            decode_none(&inst, buffer, &entry);
+            return inst;
+        case 0b10011001:
+            inst.op = OpCwd;
+            decode_none(&inst, buffer, &entry);
+            return inst;
+        case 0b10001111:
+            entry.group = pop_ops;
+            decode_rm(&inst, buffer, &entry);
+            return inst;
+        case 0b11110010:
+        case 0b11110011: {
+            inst = decode_legacy(buffer, address + 1);
+            if (inst.op != OpMovs && inst.op != OpStos && inst.op != OpLods) {
+                fatal("unsupported opcode extension encountered.");
+            }
+            inst.address = address;
+            inst.size += 1;
+            inst.flags |= FlagRep;
+            return inst;
+        }
+        default:
+            break;
+    }
+
+    if (inst.op != OpNone) { // must have matched a jmp code
+        decode_jmp(&inst, buffer, &entry);
+        return inst;
+    }
+
+    // opcodes of len 7
+    opcode >>= 1;
+    switch (opcode) {
+        case 0b1100011:
+            inst.op = OpMov;
+            decode_im_to_rm(&inst, buffer, &entry);
+            return inst;
+        case 0b1010000:
+        case 0b1010001:
+            inst.op = OpMov;
+            decode_acc_mem(&inst, buffer, &entry);
+            return inst;
+        case 0b0000010:
+            inst.op = OpAdd;
+            decode_im_to_acc(&inst, buffer, &entry);
+            return inst;
+        case 0b0010110:
+            inst.op = OpSub;
+            decode_im_to_acc(&inst, buffer, &entry);
+            return inst;
+        case 0b0011110:
+            inst.op = OpCmp;
+            decode_im_to_acc(&inst, buffer, &entry);
+            return inst;
+        case 0b0011010:
+            inst.op = OpXor;
+            decode_im_to_acc(&inst, buffer, &entry);
+            return inst;
+        case 0b0000110:
+            inst.op = OpOr;
+            decode_im_to_acc(&inst, buffer, &entry);
+            return inst;
+        case 0b0001010:
+            inst.op = OpAdc;
+            decode_im_to_acc(&inst, buffer, &entry);
+            return inst;
+        case 0b0001110:
+            inst.op = OpSbb;
+            decode_im_to_acc(&inst, buffer, &entry);
+            return inst;
+        case 0b0010010:
+            inst.op = OpAnd;
+            decode_im_to_acc(&inst, buffer, &entry);
+            return inst;
+        case 0b1010010:
+            inst.op = OpMovs;
+            decode_string(&inst, buffer, &entry);
+            return inst;
+        case 0b1010101:
+            inst.op = OpStos;
+            decode_string(&inst, buffer, &entry);
+            return inst;
+        case 0b1010110:
+            inst.op = OpLods;
+            decode_string(&inst, buffer, &entry);
+            return inst;
+        case 0b1010100:
+            inst.op = OpTest;
+            decode_im_to_acc(&inst, buffer, &entry);
+            return inst;
+        case 0b1000010:
+            inst.op = OpTest;
+            entry.d = 0;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b1111011:
+            entry.group = f6_ops;
+            decode_rm(&inst, buffer, &entry);
+            return inst;
+        case 0b1111111:
+            entry.group = entry.w ? ff_ops : fe_ops;
+            decode_rm(&inst, buffer, &entry);
+            return inst;
+        default:
+            break;
+    }
+
+    // opcodes of len 6
+    opcode >>= 1;
+    switch (opcode) {
+        case 0b100010:
+            inst.op = OpMov;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b000000:
+            inst.op = OpAdd;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b001010:
+            inst.op = OpSub;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b001110:
+            inst.op = OpCmp;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b001100:
+            inst.op = OpXor;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b000010:
+            inst.op = OpOr;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b000100:
+            inst.op = OpAdc;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b000110:
+            inst.op = OpSbb;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b001000:
+            inst.op = OpAnd;
+            decode_rm_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b100000:
+            entry.group = im_to_rm_ops;
+            decode_im_to_rm(&inst, buffer, &entry);
+            return inst;
+        case 0b110100:
+            entry.group = shift_ops;
+            decode_shift(&inst, buffer, &entry);
+            return inst;
+        default:
+            break;
+    }
+
+    // opcodes of len 4
+    opcode >>= 2;
+    switch (opcode) {
+        case 0b1011:
+            inst.op = OpMov;
+            entry.w = (buffer[inst.address] >> 3) & 1;
+            entry.reg = buffer[inst.address] & 0b111;
+            decode_im_to_reg(&inst, buffer, &entry);
+            return inst;
+        default:
+            break;
+    }
+
+    // opcodes of len 5
+    opcode = buffer[inst.address] >> 3;
+    switch (opcode) {
+        case 0b01000:
+            inst.op = OpInc;
+            entry.w = 1;
+            entry.reg = buffer[inst.address] & 0b111;
+            decode_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b01001:
+            inst.op = OpDec;
+            entry.w = 1;
+            entry.reg = buffer[inst.address] & 0b111;
+            decode_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b01010:
+            inst.op = OpPush;
+            entry.w = 1;
+            entry.reg = buffer[inst.address] & 0b111;
+            decode_reg(&inst, buffer, &entry);
+            return inst;
+        case 0b01011:
+            inst.op = OpPop;
+            entry.w = 1;
+            entry.reg = buffer[inst.address] & 0b111;
+            decode_reg(&inst, buffer, &entry);
+            return inst;
+        default:
+            break;
+    }
+
+    if (inst.op == OpNone) {
+        fatal("unknown opcode encountered.");
+    }
+
+    return inst;
+}
+
+void decode_jmp(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    Operand signed_immediate;
+    signed_immediate.kind = OperandRelativeImmediate;
+    signed_immediate.s_immediate = (i32)(i8)buffer[inst->address + 1];
+    inst->operands[0] = signed_immediate;
+    Operand none;
+    none.kind = OperandNone;
+    inst->operands[1] = none;
+    inst->size = 2;
+}
+
+// [opcode] [ip-inc-lo] [ip-inc-hi]
+void decode_jmp_near(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    u32 idx = inst->address + 1;
+    inst->operands[0].kind = OperandRelativeImmediate;
+    inst->operands[0].s_immediate = (i16)(buffer[idx + 1] << 8 | buffer[idx]);
+    inst->operands[1].kind = OperandNone;
+    inst->size = 3;
+}
+
+// [opcode] [data-lo] [data-hi], e.g. the bytes ret releases from the stack
+void decode_im16(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    inst->size = 1;
+    set_immediate_operand(inst, buffer, 0, 1, 0);
+    inst->operands[1].kind = OperandNone;
+}
+
+// operands are implied: si, di and the accumulator
+void decode_string(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    if (entry->w) {
+        inst->flags |= FlagWide;
+    }
+    inst->size = 1;
+    inst->operands[0].kind = OperandNone;
+    inst->operands[1].kind = OperandNone;
+}
+
+// a repeat prefix is decoded together with the string op it repeats
+void decode_rep(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    const OpcodeEntry *string = &opcode_table[buffer[inst->address + 1]];
+    inst->operands[0].kind = OperandNone;
+    inst->operands[1].kind = OperandNone;
+    inst->size = 1;
+    if (string->decode != decode_string) {
+        inst->op = OpNone;
+        return;
+    }
+    inst->op = string->op;
+    decode_string(inst, buffer, string);
+    inst->flags |= FlagRep;
+    inst->size += 1;
+}
+
+void decode_im_to_acc(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    inst->size = 1;
+    set_reg_operand(inst, 0, entry->w, 0);
+    set_immediate_operand(inst, buffer, 0, entry->w, 1);
+}
+
+void decode_acc_mem(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    u8 to_memory = entry->d;
+    inst->size = 1;
+    set_reg_operand(inst, 0, entry->w, to_memory);
+    set_effective_address_operand(inst, buffer, entry->w, 0b110, 0b00, to_memory ? 0 : 1);
+}
+
+void decode_im_to_rm(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    u32 idx = inst->address + 1;
+    u8 mod = buffer[idx] >> 6;
+    u8 op_type = (buffer[idx] >> 3) & 0b111;
+    u8 rm = buffer[idx] & 0b111;
+
+    if (entry->group) {
+        inst->op = entry->group[op_type];
+    }
+
+    inst->size = 2;
+    if (mod == 0b11) {
+        set_reg_operand(inst, rm, entry->w, 0);
+    } else {
+        set_effective_address_operand(inst, buffer, entry->w, rm, mod, 0);
+    }
+    set_immediate_operand(inst, buffer, inst->op == OpMov ? 0 : entry->s, entry->w, 1);
+}
+
+void decode_im_to_reg(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    set_reg_operand(inst, entry->reg, entry->w, 0);
+    inst->size = 1;
+    set_immediate_operand(inst, buffer, 0, entry->w, 1);
+}
+
+void decode_rm_reg(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    u32 idx = inst->address + 1;
+    u8 d = entry->d;
+    u8 w = entry->w;
+    u8 mod = buffer[idx] >> 6;
+    u8 reg = (buffer[idx] >> 3) & 0b111;
+    u8 rm = buffer[idx] & 0b111;
+    inst->size = 2;
+    if (mod == 0b11) {
+        set_reg_operand(inst, rm, w, d);
+    } else {
+        set_effective_address_operand(inst, buffer, w, rm, mod, d);
+    }
+    set_reg_operand(inst, reg, w, d ? 0 : 1);
+}
+
+void decode_reg(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    inst->size = 1;
+    set_reg_operand(inst, entry->reg, entry->w, 0);
+    inst->operands[1].kind = OperandNone;
+}
+
+// single register/memory operand, with any immediate (test) following the displacement
+void decode_rm(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    u32 idx = inst->address + 1;
+    u8 mod = buffer[idx] >> 6;
+    u8 op_type = (buffer[idx] >> 3) & 0b111;
+    u8 rm = buffer[idx] & 0b111;
+    inst->op = entry->group[op_type];
+
+    inst->size = 2;
+    if (mod == 0b11) {
+        set_reg_operand(inst, rm, entry->w, 0);
+    } else {
+        set_effective_address_operand(inst, buffer, entry->w, rm, mod, 0);
+    }
+    if (inst->op == OpTest) {
+        set_immediate_operand(inst, buffer, 0, entry->w, 1);
+    } else {
+        inst->operands[1].kind = OperandNone;
+    }
+}
+
+// the v bit (stored in d) selects a count of cl instead of 1
+void decode_shift(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    u32 idx = inst->address + 1;
+    u8 mod = buffer[idx] >> 6;
+    u8 op_type = (buffer[idx] >> 3) & 0b111;
+    u8 rm = buffer[idx] & 0b111;
+    inst->op = entry->group[op_type];
+
+    inst->size = 2;
+    if (mod == 0b11) {
+        set_reg_operand(inst, rm, entry->w, 0);
+    } else {
+        set_effective_address_operand(inst, buffer, entry->w, rm, mod, 0);
+    }
+    if (entry->d) {
+        inst->operands[1].kind = OperandRegister;
+        inst->operands[1].reg = (RegisterAccess){ Reg_c, 0, 1 };
+    } else {
+        inst->operands[1].kind = OperandImmediate;
+        inst->operands[1].immediate = 1;
+    }
+}
+
+void decode_none(Instruction* inst, const u8 buffer[], const OpcodeEntry* entry) {
+    inst->size = 1;
+    inst->operands[0].kind = OperandNone;
+    inst->operands[1].kind = OperandNone;
+}
+
+void set_reg_operand(Instruction* inst, u8 reg, u8 wide, u8 operand_num) {
+    if (wide) {
+        inst->flags |= FlagWide;
+    }
+    static const RegisterAccess reg_table[][2] = {
+        {{Reg_a, 0, 1}, {Reg_a, 0, 2}},
+        {{Reg_c, 0, 1}, {Reg_c, 0, 2}},
+        {{Reg_d, 0, 1}, {Reg_d, 0, 2}},
+        {{Reg_b, 0, 1}, {Reg_b, 0, 2}},
+        {{Reg_a, 1, 1}, {Reg_sp, 0, 2}},
+        {{Reg_c, 1, 1}, {Reg_bp, 0, 2}},
+        {{Reg_d, 1, 1}, {Reg_si, 0, 2}},
+        {{Reg_b, 1, 1}, {Reg_di, 0, 2}},
+    };
+    Operand res;
+    res.kind = OperandRegister;
+    res.reg = reg_table[reg][wide];
+    inst->operands[operand_num] = res;
+}
+
+void set_effective_address_operand(Instruction* inst, const u8 buffer[], u8 wide, u8 rm, u8 mod, u8 operand_num) {
+    Operand res;
+    res.kind = OperandMemory;
+    if (wide) {
+        inst->flags |= FlagWide;
+    }
+    if (mod == 0b00 && rm == 0b110) {
+        res.address.base = Ea_direct;
+    } else {
+        res.address.base = (EffectiveAddressBase) (rm + 1);
+    }
+    res.address.displacement = 0;
+    u32 idx = inst->address + inst->size - 1;
+    if (mod == 0b10 || (mod == 0b00 && rm == 0b110)) {
+        idx += 2;
+        res.address.displacement = (i16)(buffer[idx] << 8) | buffer[idx-1]; // parse as signed
+        inst->size += 2;
+    } else if (mod == 0b01) {
+        idx += 1;
+        res.address.displacement = (i16)(buffer[idx] << 8) >> 8; // sign extend to 16 bits
+        inst->size += 1;
+    }
+    inst->operands[operand_num] = res;
+}
+
+void set_immediate_operand(Instruction* inst, const u8 buffer[], u8 sign, u8 wide, u8 operand_num) {
+    Operand res;
+    res.kind = OperandImmediate;
+    u32 idx = inst->address + inst->size - 1;
+    if (sign == 0 && wide == 1) {
+        idx += 2;
+        res.immediate = (u32)((buffer[idx] << 8) | buffer[idx-1]);
+        inst->size += 2;
+    } else {
+        idx += 1;
+        if (sign == 1 && wide == 1) {
+            res.immediate = (i16)(buffer[idx] << 8) >> 8; // sign extend to 16 bits
+        } else {
+            res.immediate = (u32)(buffer[idx]);
+        }
+        inst->size += 1;
+    }
+    inst->operands[operand_num] = res;
+}
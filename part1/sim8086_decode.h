@@ -0,0 +1,10 @@
+#ifndef PERF_AWARE_SIM8086_DECODE_H
+#define PERF_AWARE_SIM8086_DECODE_H
+
+bool try_decode(const u8 buffer[], u32 address, Instruction* inst);
+Instruction decode(const u8 buffer[], u32 address);
+Instruction decode_legacy(const u8 buffer[], u32 address);
+bool operands_equal(Operand* a, Operand* b);
+bool instructions_equal(Instruction* a, Instruction* b);
+
+#endif
@@ -0,0 +1,88 @@
+#include "sim8086.h"
+#include "sim8086_print.h"
+#include "sim8086_dump.h"
+
+#include <unistd.h>
+
+#define BYTES_PER_PIXEL 4
+
+// writes [start, start + length) of memory to path, byte for byte. only dirty pages are
+// written; the file is extended over the rest, which reads back as the zeros memory holds there
+void dump_memory(Sim8086* sim, const char *path, u32 start, u32 length) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fatal("unable to create %s", path);
+    }
+    u32 end = start + length;
+    for (u32 page = start / MEMORY_PAGE_SIZE; page * MEMORY_PAGE_SIZE < end; page++) {
+        if (!sim->dirty_pages[page]) continue;
+        u32 from = page * MEMORY_PAGE_SIZE > start ? page * MEMORY_PAGE_SIZE : start;
+        u32 to = (page + 1) * MEMORY_PAGE_SIZE < end ? (page + 1) * MEMORY_PAGE_SIZE : end;
+        if (fseek(file, from - start, SEEK_SET) != 0 || fwrite(sim->memory + from, 1, to - from, file) != to - from) {
+            fclose(file);
+            fatal("unable to write %s", path);
+        }
+    }
+    fflush(file);
+    if (ftruncate(fileno(file), length) != 0) {
+        fclose(file);
+        fatal("unable to write %s", path);
+    }
+    fclose(file);
+}
+
+// writes [start, start + length) of memory to path as a binary PPM, width pixels across, with
+// every 4 bytes an RGBA pixel (alpha is dropped) as the drawing listings lay them out
+void dump_image(Sim8086* sim, const char *path, u32 start, u32 length, u32 width) {
+    u32 height = length / (width * BYTES_PER_PIXEL);
+    if (height == 0) {
+        fatal("a %u pixel wide image needs at least %u bytes", width, width * BYTES_PER_PIXEL);
+    }
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fatal("unable to create %s", path);
+    }
+    char data[64 * 1024];
+    Writer out = { file, data, 0, sizeof(data) };
+    write_format(&out, "P6\n%u %u\n255\n", width, height);
+    u8 *pixel = sim->memory + start;
+    for (u32 i = 0; i < width * height; i++, pixel += BYTES_PER_PIXEL) {
+        write_bytes(&out, (char*)pixel, 3);
+    }
+    flush_writer(&out);
+    fclose(file);
+}
+
+// lists the runs of bytes in [start, start + length) that differ from an earlier -dump of
+// the same range at path
+void diff_memory(Sim8086* sim, const char *path, u32 start, u32 length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fatal("unable to open %s", path);
+    }
+    u8 *previous = calloc(length ? length : 1, 1);
+    if (!previous) {
+        fatal("unable to allocate memory diff");
+    }
+    // bytes past the end of a shorter file count as zero
+    fread(previous, 1, length, file);
+    fclose(file);
+
+    Writer *out = &sim->out;
+    write_format(out, "\nMemory differences from %s:\n", path);
+    u32 runs = 0;
+    for (u32 i = 0; i < length;) {
+        if (sim->memory[start + i] == previous[i]) {
+            i++;
+            continue;
+        }
+        u32 first = i;
+        while (i < length && sim->memory[start + i] != previous[i]) i++;
+        write_format(out, "  0x%05x-0x%05x: %u bytes\n", start + first, start + i - 1, i - first);
+        runs++;
+    }
+    if (runs == 0) {
+        write_format(out, "  none\n");
+    }
+    free(previous);
+}
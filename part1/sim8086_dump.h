@@ -0,0 +1,15 @@
+#ifndef PERF_AWARE_SIM8086_DUMP_H
+#define PERF_AWARE_SIM8086_DUMP_H
+
+static inline void mark_dirty(Sim8086* sim, u32 address, u32 count) {
+    u32 last = (address + count - 1) / MEMORY_PAGE_SIZE;
+    for (u32 page = address / MEMORY_PAGE_SIZE; page <= last && page < MEMORY_PAGE_COUNT; page++) {
+        sim->dirty_pages[page] = true;
+    }
+}
+
+void dump_memory(Sim8086* sim, const char *path, u32 start, u32 length);
+void dump_image(Sim8086* sim, const char *path, u32 start, u32 length, u32 width);
+void diff_memory(Sim8086* sim, const char *path, u32 start, u32 length);
+
+#endif
@@ -0,0 +1,353 @@
+#include "sim8086.h"
+#include "sim8086_encode.h"
+
+// what an instruction's fields leave open about its encoding; only its size tells them apart
+typedef struct {
+    bool short_form;    // register or accumulator built into the opcode, or an 8-bit jump
+    u8 disp_size;       // bytes of memory displacement
+    bool sign_extend;   // word immediate stored as a sign extended byte
+} EncodeForm;
+
+typedef struct {
+    u8 *out;
+    u32 count;
+    bool failed;
+} Encoder;
+
+static const u8 wide_reg_fields[Reg_count] = {
+    [Reg_a] = 0, [Reg_c] = 1, [Reg_d] = 2, [Reg_b] = 3, [Reg_sp] = 4, [Reg_bp] = 5, [Reg_si] = 6, [Reg_di] = 7,
+};
+
+// group fields of the mod/reg/rm byte, and the first opcode of the two operand forms
+static const u8 group_fields[OpCount] = {
+    [OpAdd] = 0, [OpOr] = 1, [OpAdc] = 2, [OpSbb] = 3, [OpAnd] = 4, [OpSub] = 5, [OpXor] = 6, [OpCmp] = 7,
+    [OpRol] = 0, [OpRor] = 1, [OpRcl] = 2, [OpRcr] = 3, [OpShl] = 4, [OpShr] = 5, [OpSar] = 7,
+    [OpNot] = 2, [OpNeg] = 3, [OpMul] = 4, [OpImul] = 5, [OpDiv] = 6, [OpIdiv] = 7,
+    [OpInc] = 0, [OpDec] = 1, [OpCall] = 2, [OpJmp] = 4, [OpPush] = 6, [OpPop] = 0,
+};
+
+static const u8 jump_opcodes[OpCount] = {
+    [OpJo] = 0x70, [OpJno] = 0x71, [OpJb] = 0x72, [OpJnb] = 0x73,
+    [OpJe] = 0x74, [OpJne] = 0x75, [OpJbe] = 0x76, [OpJnbe] = 0x77,
+    [OpJs] = 0x78, [OpJns] = 0x79, [OpJp] = 0x7a, [OpJnp] = 0x7b,
+    [OpJl] = 0x7c, [OpJnl] = 0x7d, [OpJle] = 0x7e, [OpJnle] = 0x7f,
+    [OpLoopnz] = 0xe0, [OpLoopz] = 0xe1, [OpLoop] = 0xe2, [OpJcxz] = 0xe3,
+};
+
+static void put_byte(Encoder* e, u8 byte) {
+    e->out[e->count++] = byte;
+}
+
+static void put_word(Encoder* e, u16 word) {
+    put_byte(e, word & 0xff);
+    put_byte(e, word >> 8);
+}
+
+static bool is_register(Operand* operand) {
+    return operand->kind == OperandRegister;
+}
+
+// the 3-bit register field for a register operand of the instruction's width
+static u8 reg_field(Encoder* e, Operand* operand, bool wide) {
+    RegisterAccess reg = operand->reg;
+    if (operand->kind != OperandRegister || reg.index == Reg_none || reg.index >= Reg_count) {
+        e->failed = true;
+        return 0;
+    }
+    if (wide) {
+        if (reg.count != 2 || reg.offset != 0) e->failed = true;
+        return wide_reg_fields[reg.index];
+    }
+    if (reg.count != 1 || reg.index > Reg_d) e->failed = true;
+    return wide_reg_fields[reg.index] + 4 * reg.offset;
+}
+
+static bool is_accumulator(Encoder* e, Operand* operand, bool wide) {
+    return is_register(operand) && reg_field(e, operand, wide) == 0;
+}
+
+// [mod | reg | r/m] [disp-lo] [disp-hi]
+static void put_rm(Encoder* e, u8 reg, Operand* operand, EncodeForm form, bool wide) {
+    if (is_register(operand)) {
+        put_byte(e, 0b11000000 | reg << 3 | reg_field(e, operand, wide));
+        return;
+    }
+    if (operand->kind != OperandMemory) {
+        e->failed = true;
+        return;
+    }
+    EffectiveAddress address = operand->address;
+    i32 disp = address.displacement;
+    if (address.base == Ea_direct) {
+        put_byte(e, reg << 3 | 0b110);
+        put_word(e, (u16)disp);
+        if (form.disp_size != 2) e->failed = true;
+        return;
+    }
+    u8 rm = (u8)(address.base - 1);
+    if (form.disp_size == 0 && disp == 0 && address.base != Ea_bp) {
+        put_byte(e, reg << 3 | rm);
+    } else if (form.disp_size == 1 && disp >= -128 && disp <= 127) {
+        put_byte(e, 0b01000000 | reg << 3 | rm);
+        put_byte(e, (u8)disp);
+    } else if (form.disp_size == 2 && disp >= -32768 && disp <= 32767) {
+        put_byte(e, 0b10000000 | reg << 3 | rm);
+        put_word(e, (u16)disp);
+    } else {
+        e->failed = true;
+    }
+}
+
+// [data] [data if w], or a single byte the decoder sign extends
+static void put_immediate(Encoder* e, Operand* operand, bool wide, bool sign_extend) {
+    u32 value = operand->immediate;
+    if (operand->kind != OperandImmediate) {
+        e->failed = true;
+    } else if (!wide) {
+        if (value > 0xff || sign_extend) e->failed = true;
+        put_byte(e, (u8)value);
+    } else if (sign_extend) {
+        if (value >= 0x80 && value < 0xffffff80) e->failed = true;
+        put_byte(e, (u8)value);
+    } else {
+        if (value > 0xffff) e->failed = true;
+        put_word(e, (u16)value);
+    }
+}
+
+// [ip-inc8], or [ip-inc-lo] [ip-inc-hi] for a near jump or call
+static void put_relative(Encoder* e, Operand* operand, bool near) {
+    i32 disp = operand->s_immediate;
+    if (operand->kind != OperandRelativeImmediate || (!near && (disp < -128 || disp > 127)) ||
+        disp < -32768 || disp > 32767) {
+        e->failed = true;
+    }
+    if (near) {
+        put_word(e, (u16)disp);
+    } else {
+        put_byte(e, (u8)disp);
+    }
+}
+
+// [opcode | d | w] [mod | reg | r/m]; d is set when the register field is the destination
+static void put_rm_reg(Encoder* e, u8 opcode, Operand* dest, Operand* src, EncodeForm form, bool wide) {
+    if (is_register(src)) {
+        put_byte(e, opcode | wide);
+        put_rm(e, reg_field(e, src, wide), dest, form, wide);
+    } else if (is_register(dest)) {
+        put_byte(e, opcode | 0b10 | wide);
+        put_rm(e, reg_field(e, dest, wide), src, form, wide);
+    } else {
+        e->failed = true;
+    }
+}
+
+static void encode_mov(Encoder* e, Instruction* inst, EncodeForm form, bool wide) {
+    Operand *dest = &inst->operands[0];
+    Operand *src = &inst->operands[1];
+    if (src->kind == OperandImmediate) {
+        if (form.short_form) {
+            put_byte(e, 0xb0 | wide << 3 | reg_field(e, dest, wide));
+        } else {
+            put_byte(e, 0xc6 | wide);
+            put_rm(e, 0, dest, form, wide);
+        }
+        put_immediate(e, src, wide, false);
+    } else if (form.short_form) {
+        // the accumulator to or from a direct address
+        bool to_memory = src->kind == OperandRegister;
+        Operand *memory = to_memory ? dest : src;
+        if (!is_accumulator(e, to_memory ? src : dest, wide) || memory->kind != OperandMemory ||
+            memory->address.base != Ea_direct) {
+            e->failed = true;
+            return;
+        }
+        put_byte(e, 0xa0 | to_memory << 1 | wide);
+        put_word(e, (u16)memory->address.displacement);
+    } else {
+        put_rm_reg(e, 0x88, dest, src, form, wide);
+    }
+}
+
+// add, or, adc, sbb, and, sub, xor and cmp share one layout from the opcode group << 3
+static void encode_arithmetic(Encoder* e, Instruction* inst, EncodeForm form, bool wide) {
+    Operand *dest = &inst->operands[0];
+    Operand *src = &inst->operands[1];
+    u8 field = group_fields[inst->op];
+    if (src->kind == OperandImmediate) {
+        if (form.short_form) {
+            if (!is_accumulator(e, dest, wide)) e->failed = true;
+            put_byte(e, field << 3 | 0b100 | wide);
+            put_immediate(e, src, wide, false);
+        } else {
+            put_byte(e, 0x80 | form.sign_extend << 1 | wide);
+            put_rm(e, field, dest, form, wide);
+            put_immediate(e, src, wide, form.sign_extend);
+        }
+    } else if (form.short_form) {
+        e->failed = true;
+    } else {
+        put_rm_reg(e, field << 3, dest, src, form, wide);
+    }
+}
+
+static void encode_test(Encoder* e, Instruction* inst, EncodeForm form, bool wide) {
+    Operand *dest = &inst->operands[0];
+    Operand *src = &inst->operands[1];
+    if (src->kind == OperandImmediate) {
+        if (form.short_form) {
+            if (!is_accumulator(e, dest, wide)) e->failed = true;
+            put_byte(e, 0xa8 | wide);
+        } else {
+            put_byte(e, 0xf6 | wide);
+            put_rm(e, 0, dest, form, wide);
+        }
+        put_immediate(e, src, wide, false);
+    } else if (is_register(src) && !form.short_form) {
+        // no d bit: always register/memory then register
+        put_byte(e, 0x84 | wide);
+        put_rm(e, reg_field(e, src, wide), dest, form, wide);
+    } else {
+        e->failed = true;
+    }
+}
+
+// inc, dec, push and pop of a word register have one byte forms with the register built in
+static void encode_single(Encoder* e, Instruction* inst, EncodeForm form, bool wide, u8 short_opcode, u8 opcode) {
+    Operand *operand = &inst->operands[0];
+    if (form.short_form) {
+        if (!wide) e->failed = true;
+        put_byte(e, short_opcode | reg_field(e, operand, true));
+    } else {
+        put_byte(e, opcode);
+        put_rm(e, group_fields[inst->op], operand, form, wide);
+    }
+}
+
+static u32 encode_form(Instruction* inst, EncodeForm form, u8 out[]) {
+    Encoder e = { out, 0, false };
+    bool wide = (inst->flags & FlagWide) != 0;
+    Operand *dest = &inst->operands[0];
+    Operand *src = &inst->operands[1];
+
+    switch (inst->op) {
+        case OpMov:
+            encode_mov(&e, inst, form, wide);
+            break;
+        case OpAdd:
+        case OpOr:
+        case OpAdc:
+        case OpSbb:
+        case OpAnd:
+        case OpSub:
+        case OpXor:
+        case OpCmp:
+            encode_arithmetic(&e, inst, form, wide);
+            break;
+        case OpTest:
+            encode_test(&e, inst, form, wide);
+            break;
+        case OpInc:
+            encode_single(&e, inst, form, wide, 0x40, 0xfe | wide);
+            break;
+        case OpDec:
+            encode_single(&e, inst, form, wide, 0x48, 0xfe | wide);
+            break;
+        case OpPush:
+            encode_single(&e, inst, form, wide, 0x50, 0xff);
+            if (!wide) e.failed = true;
+            break;
+        case OpPop:
+            encode_single(&e, inst, form, wide, 0x58, 0x8f);
+            if (!wide) e.failed = true;
+            break;
+        case OpRol:
+        case OpRor:
+        case OpRcl:
+        case OpRcr:
+        case OpShl:
+        case OpShr:
+        case OpSar: {
+            // [opcode | v | w]: v selects a count in cl over a count of 1
+            bool by_cl = is_register(src);
+            if (form.short_form || (by_cl && (src->reg.index != Reg_c || src->reg.count != 1 || src->reg.offset != 0)) ||
+                (!by_cl && (src->kind != OperandImmediate || src->immediate != 1))) {
+                e.failed = true;
+            }
+            put_byte(&e, 0xd0 | by_cl << 1 | wide);
+            put_rm(&e, group_fields[inst->op], dest, form, wide);
+            break;
+        }
+        case OpNot:
+        case OpNeg:
+        case OpMul:
+        case OpImul:
+        case OpDiv:
+        case OpIdiv:
+            if (form.short_form) e.failed = true;
+            put_byte(&e, 0xf6 | wide);
+            put_rm(&e, group_fields[inst->op], dest, form, wide);
+            break;
+        case OpCbw:
+            put_byte(&e, 0x98);
+            break;
+        case OpCwd:
+            put_byte(&e, 0x99);
+            break;
+        case OpMovs:
+        case OpStos:
+        case OpLods:
+            if (inst->flags & FlagRep) {
+                put_byte(&e, 0xf3);
+            }
+            put_byte(&e, (inst->op == OpMovs ? 0xa4 : inst->op == OpStos ? 0xaa : 0xac) | wide);
+            break;
+        case OpCall:
+        case OpJmp:
+            if (dest->kind == OperandRelativeImmediate) {
+                bool near = !form.short_form;
+                if (inst->op == OpCall && !near) e.failed = true;
+                put_byte(&e, inst->op == OpCall ? 0xe8 : near ? 0xe9 : 0xeb);
+                put_relative(&e, dest, near);
+            } else {
+                if (form.short_form || !wide) e.failed = true;
+                put_byte(&e, 0xff);
+                put_rm(&e, group_fields[inst->op], dest, form, true);
+            }
+            break;
+        case OpRet:
+            if (dest->kind == OperandImmediate) {
+                put_byte(&e, 0xc2);
+                put_word(&e, (u16)dest->immediate);
+                if (dest->immediate > 0xffff) e.failed = true;
+            } else {
+                put_byte(&e, 0xc3);
+            }
+            break;
+        default:
+            if (jump_opcodes[inst->op]) {
+                put_byte(&e, jump_opcodes[inst->op]);
+                put_relative(&e, dest, false);
+            } else {
+                e.failed = true;
+            }
+            break;
+    }
+    return e.failed ? 0 : e.count;
+}
+
+// writes the machine code for inst to out, in the encoding that takes inst->size bytes, and
+// returns that size; returns 0 if the 8086 has no such encoding. where several encodings have
+// the same size, e.g. either register of a register pair in the r/m field, one is picked
+u32 encode(Instruction* inst, u8 out[]) {
+    u8 bytes[16];
+    for (u32 i = 0; i < 12; i++) {
+        EncodeForm form = { !(i & 1), (u8)(i / 4), !((i >> 1) & 1) };
+        u32 size = encode_form(inst, form, bytes);
+        if (size && size == inst->size) {
+            memcpy(out, bytes, size);
+            return size;
+        }
+    }
+    return 0;
+}
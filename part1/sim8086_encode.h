@@ -0,0 +1,6 @@
+#ifndef PERF_AWARE_SIM8086_ENCODE_H
+#define PERF_AWARE_SIM8086_ENCODE_H
+
+u32 encode(Instruction* inst, u8 out[]);
+
+#endif
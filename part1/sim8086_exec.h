@@ -0,0 +1,52 @@
+#ifndef PERF_AWARE_SIM8086_EXEC_H
+#define PERF_AWARE_SIM8086_EXEC_H
+
+// execution helpers shared by the interpreter in sim8086.c and the basic block engine in
+// sim8086_block.c; all machine state lives in the Sim8086 passed to them
+
+extern bool clocks;
+extern bool stats;
+extern bool is_8088;
+
+u16 get_memory_address(Sim8086* sim, EffectiveAddress* address);
+bool is_jump(OpType op);
+bool is_branch(OpType op);
+bool branch_taken(Sim8086* sim, Instruction* inst);
+bool get_flag(Sim8086* sim, Flag flag);
+u16 get_flags(Sim8086* sim);
+bool condition_holds(Sim8086* sim, OpType op);
+ExecuteFunction* select_executor(Instruction* inst);
+void execute_instruction(Sim8086* sim, Instruction* inst);
+void code_written(Sim8086* sim, u32 address, u32 count);
+void print_run_summary(Sim8086* sim, u64 inst_count, u64 time, u64 elapsed);
+
+static inline void record_flags(Sim8086* sim, OpType op, u16 dest, u16 src, u16 result, bool wide) {
+    sim->lazy_flags.op = op;
+    sim->lazy_flags.dest = dest;
+    sim->lazy_flags.src = src;
+    sim->lazy_flags.result = result;
+    sim->lazy_flags.wide = wide;
+}
+
+// inc and dec leave the carry flag as it was, so it is materialized before the record is replaced
+static inline void record_flags_keep_carry(Sim8086* sim, OpType op, u16 dest, u16 src, u16 result, bool wide) {
+    sim->lazy_flags.carry = get_flag(sim, Carry_flag);
+    record_flags(sim, op, dest, src, result, wide);
+}
+
+// adc and sbb also take in the carry flag, which the new carry and overflow depend on
+static inline void record_flags_carry_in(Sim8086* sim, OpType op, u16 dest, u16 src, u16 result, bool wide, bool carry) {
+    record_flags(sim, op, dest, src, result, wide);
+    sim->lazy_flags.carry = carry;
+}
+
+// rotates, mul and imul set carry and overflow and leave every other flag as it was
+static inline void record_carry_overflow(Sim8086* sim, OpType op, bool carry, bool overflow) {
+    u16 flags = get_flags(sim) & ~(Carry_flag | Overflow_flag);
+    if (carry) flags |= Carry_flag;
+    if (overflow) flags |= Overflow_flag;
+    sim->lazy_flags.op = op;
+    sim->lazy_flags.flags = flags;
+}
+
+#endif
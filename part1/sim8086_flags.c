@@ -0,0 +1,112 @@
+#include "sim8086.h"
+#include "sim8086_exec.h"
+
+// arithmetic ops only record their operands and result (see record_flags); individual
+// flags are worked out from that record when something actually reads them. logic ops
+// (and, or, xor, test) always clear carry, aux carry and overflow. rotates, mul and imul
+// only set carry and overflow, so they record every flag as it ends up (see record_carry_overflow)
+
+static inline u16 sign_bit(LazyFlags* f) {
+    return f->wide ? 0x8000 : 0x80;
+}
+
+static inline u16 width_mask(LazyFlags* f) {
+    return f->wide ? 0xffff : 0xff;
+}
+
+bool get_flag(Sim8086* sim, Flag flag) {
+    LazyFlags *f = &sim->lazy_flags;
+    switch (f->op) {
+        case OpRol ... OpImul: return (f->flags & flag) != 0;
+        default: break;
+    }
+    switch (flag) {
+        case Zero_flag:
+            return f->op != OpNone && (f->result & width_mask(f)) == 0;
+        case Sign_flag:
+            return f->op != OpNone && (f->result & sign_bit(f)) != 0;
+        case Parity_flag:
+            return f->op != OpNone && !__builtin_parity(f->result & 0xff);
+        case Aux_carry_flag:
+            switch (f->op) {
+                case OpAdd:
+                case OpAdc:
+                case OpSub:
+                case OpSbb:
+                case OpCmp:
+                case OpInc:
+                case OpDec: return ((f->dest ^ f->src ^ f->result) & 0x10) != 0;
+                default: return false;
+            }
+        case Carry_flag:
+            switch (f->op) {
+                case OpAdd: return (u32)(f->dest & width_mask(f)) + (f->src & width_mask(f)) > width_mask(f);
+                case OpAdc: return (u32)(f->dest & width_mask(f)) + (f->src & width_mask(f)) + f->carry > width_mask(f);
+                case OpSub:
+                case OpCmp: return (f->src & width_mask(f)) > (f->dest & width_mask(f));
+                case OpSbb: return (u32)(f->src & width_mask(f)) + f->carry > (f->dest & width_mask(f));
+                case OpInc:
+                case OpDec: return f->carry;
+                // src holds the shift count, which is never zero for a recorded shift
+                case OpShl: return f->src <= (f->wide ? 16 : 8) && ((f->dest << (f->src - 1)) & sign_bit(f)) != 0;
+                case OpShr: return f->src <= 16 && ((f->dest & width_mask(f)) >> (f->src - 1) & 1) != 0;
+                // bits shifted in past the width are copies of the sign
+                case OpSar: {
+                    i32 value = f->wide ? (i16)f->dest : (i8)f->dest;
+                    return ((value >> (f->src > 16 ? 16 : f->src - 1)) & 1) != 0;
+                }
+                default: return false;
+            }
+        case Overflow_flag:
+            switch (f->op) {
+                case OpAdd:
+                case OpAdc:
+                case OpInc: return (~(f->dest ^ f->src) & (f->dest ^ f->result) & sign_bit(f)) != 0;
+                case OpSub:
+                case OpSbb:
+                case OpCmp:
+                case OpDec: return ((f->dest ^ f->src) & (f->dest ^ f->result) & sign_bit(f)) != 0;
+                // only defined for single bit shifts
+                case OpShl: return ((f->result & sign_bit(f)) != 0) != get_flag(sim, Carry_flag);
+                case OpShr: return (f->dest & sign_bit(f)) != 0;
+                default: return false;
+            }
+        default:
+            return false;
+    }
+}
+
+// materializes every flag, e.g. for printing
+u16 get_flags(Sim8086* sim) {
+    static const Flag all_flags[] = {
+            Carry_flag, Parity_flag, Aux_carry_flag, Zero_flag, Sign_flag, Overflow_flag,
+    };
+    u16 res = 0;
+    for (u32 i = 0; i < len(all_flags); i++) {
+        if (get_flag(sim, all_flags[i])) res |= all_flags[i];
+    }
+    return res;
+}
+
+// evaluates the condition of a conditional jump
+bool condition_holds(Sim8086* sim, OpType op) {
+    switch (op) {
+        case OpJe: return get_flag(sim, Zero_flag);
+        case OpJne: return !get_flag(sim, Zero_flag);
+        case OpJl: return get_flag(sim, Sign_flag) != get_flag(sim, Overflow_flag);
+        case OpJnl: return get_flag(sim, Sign_flag) == get_flag(sim, Overflow_flag);
+        case OpJle: return get_flag(sim, Zero_flag) || get_flag(sim, Sign_flag) != get_flag(sim, Overflow_flag);
+        case OpJnle: return !get_flag(sim, Zero_flag) && get_flag(sim, Sign_flag) == get_flag(sim, Overflow_flag);
+        case OpJb: return get_flag(sim, Carry_flag);
+        case OpJnb: return !get_flag(sim, Carry_flag);
+        case OpJbe: return get_flag(sim, Carry_flag) || get_flag(sim, Zero_flag);
+        case OpJnbe: return !get_flag(sim, Carry_flag) && !get_flag(sim, Zero_flag);
+        case OpJp: return get_flag(sim, Parity_flag);
+        case OpJnp: return !get_flag(sim, Parity_flag);
+        case OpJo: return get_flag(sim, Overflow_flag);
+        case OpJno: return !get_flag(sim, Overflow_flag);
+        case OpJs: return get_flag(sim, Sign_flag);
+        case OpJns: return !get_flag(sim, Sign_flag);
+        default: return false;
+    }
+}
@@ -0,0 +1,163 @@
+#include "sim8086.h"
+#include "sim8086_decode.h"
+#include "sim8086_print.h"
+#include "sim8086_clock.h"
+#include "sim8086_encode.h"
+#include "sim8086_fuzz.h"
+
+#define TIMING_REPETITIONS 16
+
+// xorshift64*, so a seed always generates the same stream
+static u64 next_random(u64* state) {
+    u64 x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+// fills buffer with up to count instructions by drawing random bytes and keeping the draws the
+// table decoder accepts, so every supported encoding turns up about as often as its first byte
+// does. returns the size of the stream
+static u32 generate_stream(u8 buffer[], u32 capacity, u32 count, u64 seed, u32* generated) {
+    u64 state = seed ? seed : 1; // xorshift never leaves 0
+    u32 address = 0;
+    u32 n = 0;
+    Instruction inst;
+    while (n < count && address + MAX_INSTRUCTION_SIZE <= capacity) {
+        u64 bits = next_random(&state);
+        for (u32 i = 0; i < MAX_INSTRUCTION_SIZE; i++) {
+            buffer[address + i] = (u8)(bits >> (8 * i));
+        }
+        if (try_decode(buffer, address, &inst)) {
+            address += inst.size;
+            n++;
+        }
+    }
+    memset(buffer + address, 0, MAX_INSTRUCTION_SIZE);
+    *generated = n;
+    return address;
+}
+
+// stops with the instruction, its bytes and what went wrong with it
+static void fuzz_failed(const char *problem, Instruction* inst, const u8 buffer[]) {
+    char text[128];
+    Writer out = { NULL, text, 0, sizeof(text) - 1 };
+    write_instruction(&out, inst);
+    for (u32 i = 0; i < inst->size; i++) {
+        write_format(&out, i ? " %02x" : " (%02x", buffer[inst->address + i]);
+    }
+    write_char(&out, ')');
+    text[out.count] = '\0';
+    fatal("%s at address %u: %s", problem, inst->address, text);
+}
+
+static void write_rate(Writer* out, const char *name, u64 time, f64 total, u64 cpu_freq) {
+    write_format(out, "%8s: %.2f cycles/instruction (%.2f Minst/s)\n", name,
+                 (f64)time / total, total / ((f64)time / (f64)cpu_freq) / 1e6);
+}
+
+// generates a random stream of count supported instructions into memory and checks every one:
+// the legacy decoder has to agree with the table, it has to print, and encoding it has to give
+// bytes of the same size that decode back to the same instruction and encode again unchanged.
+// reports which ops the stream covered and the cost of printing and encoding, and returns the
+// stream's size so the decoders can be timed over it
+u32 fuzz_decoder(Sim8086* sim, u32 count, u64 seed) {
+    u8 *buffer = sim->memory;
+    u32 generated;
+    u32 size = generate_stream(buffer, MEMORY_SIZE, count, seed, &generated);
+    u8 *encoded = calloc(MEMORY_SIZE + MAX_INSTRUCTION_SIZE, 1);
+    if (!encoded) {
+        fatal("unable to allocate encoded stream");
+    }
+
+    char text[128];
+    Writer printed = { NULL, text, 0, sizeof(text) };
+    u32 op_counts[OpCount] = { 0 };
+    bool opcode_seen[256] = { false };
+    for (u32 address = 0; address < size;) {
+        Instruction inst = decode(buffer, address);
+        Instruction legacy = decode_legacy(buffer, address);
+        if (!instructions_equal(&inst, &legacy)) {
+            fuzz_failed("decoders disagree", &inst, buffer);
+        }
+        printed.count = 0;
+        write_instruction(&printed, &inst);
+        if (encode(&inst, encoded + address) != inst.size) {
+            fuzz_failed("no encoding of the same size", &inst, buffer);
+        }
+        op_counts[inst.op]++;
+        opcode_seen[buffer[address]] = true;
+        address += inst.size;
+    }
+
+    // every encoding has the size of the original, so the re-encoded stream lines up with it
+    for (u32 address = 0; address < size;) {
+        Instruction inst = decode(buffer, address);
+        Instruction again;
+        u8 bytes[MAX_INSTRUCTION_SIZE];
+        if (!try_decode(encoded, address, &again) || !instructions_equal(&inst, &again)) {
+            fuzz_failed("encoding decodes differently", &inst, buffer);
+        }
+        if (encode(&again, bytes) != again.size || memcmp(bytes, encoded + address, again.size) != 0) {
+            fuzz_failed("encoding is not stable", &again, encoded);
+        }
+        address += inst.size;
+    }
+
+    Instruction *insts = malloc((generated ? generated : 1) * sizeof(Instruction));
+    if (!insts) {
+        fatal("unable to allocate fuzzed instructions");
+    }
+    for (u32 address = 0, i = 0; address < size; i++) {
+        insts[i] = decode(buffer, address);
+        address += insts[i].size;
+    }
+
+    u64 print_start = read_cpu_timer();
+    for (u32 rep = 0; rep < TIMING_REPETITIONS; rep++) {
+        for (u32 i = 0; i < generated; i++) {
+            printed.count = 0;
+            write_instruction(&printed, &insts[i]);
+        }
+    }
+    u64 print_time = read_cpu_timer() - print_start;
+
+    u64 encode_start = read_cpu_timer();
+    for (u32 rep = 0; rep < TIMING_REPETITIONS; rep++) {
+        for (u32 i = 0; i < generated; i++) {
+            encode(&insts[i], encoded + insts[i].address);
+        }
+    }
+    u64 encode_time = read_cpu_timer() - encode_start;
+
+    Writer *out = &sim->out;
+    u32 ops_covered = 0;
+    u32 opcodes_covered = 0;
+    for (u32 op = OpNone + 1; op < OpCount; op++) {
+        ops_covered += op_counts[op] != 0;
+    }
+    for (u32 i = 0; i < 256; i++) {
+        opcodes_covered += opcode_seen[i];
+    }
+    write_format(out, "Fuzzed %u instructions (%u bytes) from seed %lu\n", generated, size, seed);
+    write_format(out, "Covered %u of %u ops with %u distinct first bytes\n", ops_covered, OpCount - 1, opcodes_covered);
+    for (u32 op = OpNone + 1; op < OpCount; op++) {
+        if (op_counts[op] == 0) {
+            Instruction missing = { 0, 0, (OpType)op, { { OperandNone }, { OperandNone } }, 0 };
+            printed.count = 0;
+            write_instruction(&printed, &missing);
+            write_format(out, "%8s: %.*s\n", "missing", printed.count, text);
+        }
+    }
+    write_format(out, "Every instruction decoded the same both ways and round tripped through encode\n");
+    u64 cpu_freq = estimate_cpu_timer_freq();
+    f64 total = (f64)generated * TIMING_REPETITIONS;
+    write_rate(out, "print", print_time, total, cpu_freq);
+    write_rate(out, "encode", encode_time, total, cpu_freq);
+
+    free(insts);
+    free(encoded);
+    return size;
+}
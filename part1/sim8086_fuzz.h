@@ -0,0 +1,6 @@
+#ifndef PERF_AWARE_SIM8086_FUZZ_H
+#define PERF_AWARE_SIM8086_FUZZ_H
+
+u32 fuzz_decoder(Sim8086* sim, u32 count, u64 seed);
+
+#endif
@@ -0,0 +1,250 @@
+#include "sim8086.h"
+#include "sim8086_decode.h"
+#include "sim8086_print.h"
+#include "sim8086_clock.h"
+#include "sim8086_exec.h"
+#include "sim8086_packed.h"
+
+#define MAX_EXECUTE_REPETITIONS 256
+#define MAX_EXECUTE_STEPS (16 * 1024 * 1024)  // cap on the steps of one run, for images that never halt
+
+// allocates program for an image spanning [start, end)
+void init_program(DecodedProgram* program, u32 start, u32 end) {
+    u32 capacity = end > start ? end - start : 1;
+    program->start = start;
+    program->end = end;
+    program->count = 0;
+    program->address = malloc(capacity * sizeof(u32));
+    program->op = malloc(capacity);
+    program->size = malloc(capacity);
+    program->flags = malloc(capacity);
+    program->operands[0] = malloc(capacity * sizeof(PackedOperand));
+    program->operands[1] = malloc(capacity * sizeof(PackedOperand));
+    program->index_at = malloc(capacity * sizeof(u32));
+    if (!program->address || !program->op || !program->size || !program->flags ||
+        !program->operands[0] || !program->operands[1] || !program->index_at) {
+        fatal("unable to allocate decoded program");
+    }
+}
+
+// decodes the program's image in buffer one instruction after another, stopping with an
+// error at anything run() would stop at
+void decode_program(DecodedProgram* program, const u8 buffer[]) {
+    u32 start = program->start;
+    u32 end = program->end;
+    program->count = 0;
+    memset(program->index_at, 0xff, (end - start) * sizeof(u32));
+
+    for (u32 address = start; address < end;) {
+        Instruction inst = decode(buffer, address);
+        if (address + inst.size > end) {
+            fatal("instruction exceeds disassembly region.");
+        }
+        u32 index = program->count++;
+        program->index_at[address - start] = index;
+        program->address[index] = address;
+        program->op[index] = inst.op;
+        program->size[index] = inst.size;
+        program->flags[index] = inst.flags;
+        program->operands[0][index] = pack_operand(&inst.operands[0]);
+        program->operands[1][index] = pack_operand(&inst.operands[1]);
+        address += inst.size;
+    }
+}
+
+void free_program(DecodedProgram* program) {
+    free(program->address);
+    free(program->op);
+    free(program->size);
+    free(program->flags);
+    free(program->operands[0]);
+    free(program->operands[1]);
+    free(program->index_at);
+}
+
+// ======================================== Benchmark ======================================= //
+
+// machine state a benchmark run starts from, so every representation executes the same work
+typedef struct {
+    u16 reg_state[Reg_count];
+    LazyFlags lazy_flags;
+    u32 ip;
+    u32 call_depth;
+    u8 *memory;
+} Snapshot;
+
+static void take_snapshot(Sim8086* sim, Snapshot* snapshot) {
+    memcpy(snapshot->reg_state, sim->reg_state, sizeof(sim->reg_state));
+    snapshot->lazy_flags = sim->lazy_flags;
+    snapshot->ip = sim->ip;
+    snapshot->call_depth = sim->call_depth;
+    snapshot->memory = malloc(MEMORY_SIZE);
+    if (!snapshot->memory) {
+        fatal("unable to allocate memory snapshot");
+    }
+    memcpy(snapshot->memory, sim->memory, MEMORY_SIZE);
+}
+
+static void restore_snapshot(Sim8086* sim, Snapshot* snapshot) {
+    memcpy(sim->reg_state, snapshot->reg_state, sizeof(sim->reg_state));
+    sim->lazy_flags = snapshot->lazy_flags;
+    sim->ip = snapshot->ip;
+    sim->call_depth = snapshot->call_depth;
+    sim->halted = false;
+    memcpy(sim->memory, snapshot->memory, MEMORY_SIZE);
+}
+
+static inline void step(Sim8086* sim, Instruction* inst) {
+    sim->ip += inst->size;
+    execute_instruction(sim, inst);
+}
+
+// the runners below differ only in where the instruction at ip comes from. a jump into the
+// middle of a decoded instruction falls back to decoding at ip. each stops after limit steps
+static u64 execute_structs(Sim8086* sim, Instruction* insts, u32* index_at, u64 limit) {
+    u64 count = 0;
+    while (sim->ip < sim->code_end && !sim->halted && count < limit) {
+        u32 index = index_at[sim->ip - sim->code_start];
+        Instruction inst = index != NO_INSTRUCTION ? insts[index] : decode(sim->memory, sim->ip);
+        step(sim, &inst);
+        count++;
+    }
+    return count;
+}
+
+static u64 execute_packed(Sim8086* sim, PackedInstruction* packed, u32* index_at, u64 limit) {
+    u64 count = 0;
+    while (sim->ip < sim->code_end && !sim->halted && count < limit) {
+        u32 index = index_at[sim->ip - sim->code_start];
+        Instruction inst = index != NO_INSTRUCTION ? unpack_instruction(&packed[index], sim->ip) : decode(sim->memory, sim->ip);
+        step(sim, &inst);
+        count++;
+    }
+    return count;
+}
+
+static u64 execute_program(Sim8086* sim, DecodedProgram* program, u64 limit) {
+    u64 count = 0;
+    while (sim->ip < sim->code_end && !sim->halted && count < limit) {
+        u32 index = program->index_at[sim->ip - sim->code_start];
+        Instruction inst = index != NO_INSTRUCTION ? program_instruction(program, index) : decode(sim->memory, sim->ip);
+        step(sim, &inst);
+        count++;
+    }
+    return count;
+}
+
+static void write_rate(Writer* out, const char *name, u64 time, f64 total, u64 cpu_freq) {
+    write_format(out, "%8s: %.2f cycles/instruction (%.2f Minst/s)\n", name,
+                 (f64)time / total, total / ((f64)time / (f64)cpu_freq) / 1e6);
+}
+
+// compares the full Instruction struct against the packed encoding and the structure of
+// arrays container: the cost of decoding the image into each, then of executing from each
+void benchmark_packed(Sim8086* sim) {
+    u32 start = sim->code_start;
+    u32 end = sim->code_end;
+    u32 size = end - start;
+    u32 capacity = size ? size : 1;
+    Instruction *insts = malloc(capacity * sizeof(Instruction));
+    PackedInstruction *packed = malloc(capacity * sizeof(PackedInstruction));
+    DecodedProgram program;
+    init_program(&program, start, end);
+    decode_program(&program, sim->memory);
+
+    // every instruction has to come back unchanged
+    u32 count = program.count;
+    for (u32 i = 0; i < count; i++) {
+        Instruction inst = decode(sim->memory, program.address[i]);
+        PackedInstruction p = pack_instruction(&inst);
+        Instruction from_packed = unpack_instruction(&p, inst.address);
+        Instruction from_program = program_instruction(&program, i);
+        if (!instructions_equal(&inst, &from_packed) || !instructions_equal(&inst, &from_program)) {
+            fatal("packed encoding does not round trip at address %u.", inst.address);
+        }
+    }
+
+    const u64 target_bytes = 64 * 1024 * 1024;
+    u64 repetitions = size ? (target_bytes + size - 1) / size : 0;
+
+    u64 struct_start = read_cpu_timer();
+    for (u64 rep = 0; rep < repetitions; rep++) {
+        u32 n = 0;
+        for (u32 address = start; address < end; n++) {
+            insts[n] = decode(sim->memory, address);
+            address += insts[n].size;
+        }
+    }
+    u64 struct_time = read_cpu_timer() - struct_start;
+
+    u64 packed_start = read_cpu_timer();
+    for (u64 rep = 0; rep < repetitions; rep++) {
+        u32 n = 0;
+        for (u32 address = start; address < end; n++) {
+            Instruction inst = decode(sim->memory, address);
+            packed[n] = pack_instruction(&inst);
+            address += inst.size;
+        }
+    }
+    u64 packed_time = read_cpu_timer() - packed_start;
+
+    u64 program_start = read_cpu_timer();
+    for (u64 rep = 0; rep < repetitions; rep++) {
+        decode_program(&program, sim->memory);
+    }
+    u64 program_time = read_cpu_timer() - program_start;
+
+    u64 cpu_freq = estimate_cpu_timer_freq();
+    Writer *out = &sim->out;
+    u32 program_bytes = sizeof(u32) + 3 + 2 * sizeof(PackedOperand);
+    write_format(out, "Bytes per instruction: struct %u, packed %u, soa %u (plus %u per image byte to index by address)\n",
+                 (u32)sizeof(Instruction), (u32)sizeof(PackedInstruction), program_bytes, (u32)sizeof(u32));
+    write_format(out, "Decoded %u instructions (%u bytes) x %lu repetitions\n", count, size, repetitions);
+    f64 total = (f64)count * (f64)repetitions;
+    write_rate(out, "struct", struct_time, total, cpu_freq);
+    write_rate(out, "packed", packed_time, total, cpu_freq);
+    write_rate(out, "soa", program_time, total, cpu_freq);
+
+    // executes the program to its end from the same starting state with each representation
+    Snapshot snapshot;
+    take_snapshot(sim, &snapshot);
+    u64 executed = execute_structs(sim, insts, program.index_at, MAX_EXECUTE_STEPS);
+    bool capped = sim->ip < sim->code_end && !sim->halted;
+    u64 execute_repetitions = executed ? 16 * 1024 * 1024 / executed : 1;
+    if (execute_repetitions < 1) execute_repetitions = 1;
+    if (execute_repetitions > MAX_EXECUTE_REPETITIONS) execute_repetitions = MAX_EXECUTE_REPETITIONS;
+
+    u64 times[3] = { 0 };
+    u64 counts[3] = { 0 };
+    for (u64 rep = 0; rep < execute_repetitions; rep++) {
+        restore_snapshot(sim, &snapshot);
+        u64 t = read_cpu_timer();
+        counts[0] += execute_structs(sim, insts, program.index_at, executed);
+        times[0] += read_cpu_timer() - t;
+
+        restore_snapshot(sim, &snapshot);
+        t = read_cpu_timer();
+        counts[1] += execute_packed(sim, packed, program.index_at, executed);
+        times[1] += read_cpu_timer() - t;
+
+        restore_snapshot(sim, &snapshot);
+        t = read_cpu_timer();
+        counts[2] += execute_program(sim, &program, executed);
+        times[2] += read_cpu_timer() - t;
+    }
+    if (counts[1] != counts[0] || counts[2] != counts[0]) {
+        fatal("representations executed different instruction counts.");
+    }
+
+    write_format(out, "Executed %lu instructions x %lu repetitions%s\n", executed, execute_repetitions,
+                 capped ? " (stopped at the step limit, as the program had not halted)" : "");
+    total = (f64)counts[0];
+    write_rate(out, "struct", times[0], total, cpu_freq);
+    write_rate(out, "packed", times[1], total, cpu_freq);
+    write_rate(out, "soa", times[2], total, cpu_freq);
+
+    free(snapshot.memory);
+    free_program(&program);
+    free(packed);
+    free(insts);
+}
@@ -0,0 +1,90 @@
+#ifndef PERF_AWARE_SIM8086_PACKED_H
+#define PERF_AWARE_SIM8086_PACKED_H
+
+_Static_assert(sizeof(PackedInstruction) == 12, "PackedInstruction should stay 12 bytes");
+
+static inline OperandType packed_kind(PackedOperand operand) {
+    return (OperandType)(operand.kind & PACKED_KIND_MASK);
+}
+
+static inline RegisterAccess packed_register(PackedOperand operand) {
+    return (RegisterAccess){ (Register)(operand.selector & 0x0f), (operand.selector >> 4) & 1, operand.selector >> 5 };
+}
+
+static inline EffectiveAddress packed_address(PackedOperand operand) {
+    return (EffectiveAddress){ Reg_none, (EffectiveAddressBase)operand.selector, (i16)operand.value };
+}
+
+static inline u32 packed_immediate(PackedOperand operand) {
+    return operand.kind & PACKED_SIGNED ? (u32)(i32)(i16)operand.value : operand.value;
+}
+
+static inline i32 packed_relative_immediate(PackedOperand operand) {
+    return (i16)operand.value;
+}
+
+static inline PackedOperand pack_operand(Operand* operand) {
+    PackedOperand res = { operand->kind, 0, 0 };
+    switch (operand->kind) {
+        case OperandRegister:
+            res.selector = operand->reg.index | operand->reg.offset << 4 | operand->reg.count << 5;
+            break;
+        case OperandMemory:
+            res.selector = operand->address.base;
+            res.value = (u16)operand->address.displacement;
+            break;
+        case OperandImmediate:
+            res.value = (u16)operand->immediate;
+            if ((i32)operand->immediate < 0) res.kind |= PACKED_SIGNED;
+            break;
+        case OperandRelativeImmediate:
+            res.value = (u16)operand->s_immediate;
+            break;
+        default:
+            break;
+    }
+    return res;
+}
+
+static inline Operand unpack_operand(PackedOperand packed) {
+    Operand res;
+    res.kind = packed_kind(packed);
+    switch (res.kind) {
+        case OperandRegister: res.reg = packed_register(packed); break;
+        case OperandMemory: res.address = packed_address(packed); break;
+        case OperandImmediate: res.immediate = packed_immediate(packed); break;
+        case OperandRelativeImmediate: res.s_immediate = packed_relative_immediate(packed); break;
+        default: break;
+    }
+    return res;
+}
+
+static inline PackedInstruction pack_instruction(Instruction* inst) {
+    return (PackedInstruction){
+            inst->op, inst->size, inst->flags, 0,
+            { pack_operand(&inst->operands[0]), pack_operand(&inst->operands[1]) },
+    };
+}
+
+static inline Instruction unpack_instruction(PackedInstruction* packed, u32 address) {
+    return (Instruction){
+            address, packed->size, (OpType)packed->op,
+            { unpack_operand(packed->operands[0]), unpack_operand(packed->operands[1]) },
+            packed->flags,
+    };
+}
+
+static inline Instruction program_instruction(DecodedProgram* program, u32 index) {
+    return (Instruction){
+            program->address[index], program->size[index], (OpType)program->op[index],
+            { unpack_operand(program->operands[0][index]), unpack_operand(program->operands[1][index]) },
+            program->flags[index],
+    };
+}
+
+void init_program(DecodedProgram* program, u32 start, u32 end);
+void decode_program(DecodedProgram* program, const u8 buffer[]);
+void free_program(DecodedProgram* program);
+void benchmark_packed(Sim8086* sim);
+
+#endif
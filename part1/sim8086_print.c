@@ -1,117 +1,296 @@
 #include "sim8086.h"
 #include "sim8086_print.h"
 
-char* get_mnemonic(u32 idx) {
-    char *mnemonics[] = {
-            "",
-            "mov",
-            "add",
-            "sub",
-            "cmp",
-            "je",
-            "jl",
-            "jle",
-            "jb",
-            "jbe",
-            "jp",
-            "jo",
-            "js",
-            "jne",
-            "jnl",
-            "jnle",
-            "jnb",
-            "jnbe",
-            "jnp",
-            "jno",
-            "jns",
-            "loop",
-            "loopz",
-            "loopnz",
-            "jcxz",
-    };
-    return mnemonics[idx];
+#include <stdarg.h>
+
+#define STRING(s) { sizeof(s) - 1, s }
+
+static const String mnemonics[] = {
+        STRING(""),
+        STRING("mov"),
+        STRING("add"),
+        STRING("sub"),
+        STRING("cmp"),
+        STRING("xor"),
+        STRING("test"),
+        STRING("inc"),
+        STRING("dec"),
+        STRING("shl"),
+        STRING("shr"),
+        STRING("and"),
+        STRING("or"),
+        STRING("adc"),
+        STRING("sbb"),
+        STRING("not"),
+        STRING("neg"),
+        STRING("sar"),
+        STRING("rol"),
+        STRING("ror"),
+        STRING("rcl"),
+        STRING("rcr"),
+        STRING("mul"),
+        STRING("imul"),
+        STRING("div"),
+        STRING("idiv"),
+        STRING("cbw"),
+        STRING("cwd"),
+        STRING("push"),
+        STRING("pop"),
+        STRING("movs"),
+        STRING("stos"),
+        STRING("lods"),
+        STRING("call"),
+        STRING("jmp"),
+        STRING("ret"),
+        STRING("je"),
+        STRING("jl"),
+        STRING("jle"),
+        STRING("jb"),
+        STRING("jbe"),
+        STRING("jp"),
+        STRING("jo"),
+        STRING("js"),
+        STRING("jne"),
+        STRING("jnl"),
+        STRING("jnle"),
+        STRING("jnb"),
+        STRING("jnbe"),
+        STRING("jnp"),
+        STRING("jno"),
+        STRING("jns"),
+        STRING("loop"),
+        STRING("loopz"),
+        STRING("loopnz"),
+        STRING("jcxz"),
+};
+
+static const String reg_names[][3] = {
+        {STRING(""),   STRING(""),   STRING("")},
+        {STRING("al"), STRING("ah"), STRING("ax")},
+        {STRING("bl"), STRING("bh"), STRING("bx")},
+        {STRING("cl"), STRING("ch"), STRING("cx")},
+        {STRING("dl"), STRING("dh"), STRING("dx")},
+        {STRING("sp"), STRING("sp"), STRING("sp")},
+        {STRING("bp"), STRING("bp"), STRING("bp")},
+        {STRING("si"), STRING("si"), STRING("si")},
+        {STRING("di"), STRING("di"), STRING("di")},
+};
+
+static const String rm_base[] = {
+        STRING(""),
+        STRING("bx+si"),
+        STRING("bx+di"),
+        STRING("bp+si"),
+        STRING("bp+di"),
+        STRING("si"),
+        STRING("di"),
+        STRING("bp"),
+        STRING("bx"),
+};
+
+// ======================================== Writer ======================================== //
+
+void flush_writer(Writer *writer) {
+    if (writer->count) {
+        fwrite(writer->data, 1, writer->count, writer->file);
+        writer->count = 0;
+    }
 }
 
-char* get_reg_name(u32 reg_idx, u32 part_idx) {
-    char *reg_names[][3] = {
-            {"",   "",   ""},
-            {"al", "ah", "ax"},
-            {"bl", "bh", "bx"},
-            {"cl", "ch", "cx"},
-            {"dl", "dh", "dx"},
-            {"sp", "sp", "sp"},
-            {"bp", "bp", "bp"},
-            {"si", "si", "si"},
-            {"di", "di", "di"},
-    };
-    return reg_names[reg_idx][part_idx];
+// makes room for at least count bytes, flushing the buffered output if necessary
+static inline char* reserve(Writer *writer, u32 count) {
+    if (writer->count + count > writer->capacity) {
+        flush_writer(writer);
+    }
+    return writer->data + writer->count;
 }
 
-char* get_effective_address_base_name(EffectiveAddress address) {
-    char *rm_base[] = {
-            "",
-            "bx+si",
-            "bx+di",
-            "bp+si",
-            "bp+di",
-            "si",
-            "di",
-            "bp",
-            "bx",
-    };
-    return rm_base[address.base];
+void write_bytes(Writer *writer, const char *data, u32 count) {
+    if (count > writer->capacity) {
+        flush_writer(writer);
+        fwrite(data, 1, count, writer->file);
+        return;
+    }
+    memcpy(reserve(writer, count), data, count);
+    writer->count += count;
+}
+
+void write_string(Writer *writer, String string) {
+    write_bytes(writer, string.data, string.count);
+}
+
+void write_char(Writer *writer, char c) {
+    *reserve(writer, 1) = c;
+    writer->count++;
+}
+
+void write_u32(Writer *writer, u32 value) {
+    char digits[10];
+    u32 n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    char *dest = reserve(writer, n);
+    for (u32 i = 0; i < n; i++) {
+        dest[i] = digits[n - 1 - i];
+    }
+    writer->count += n;
+}
+
+// writes a signed decimal; always_sign matches printf's "%+d"
+void write_i32(Writer *writer, i32 value, bool always_sign) {
+    if (value < 0) {
+        write_char(writer, '-');
+    } else if (always_sign) {
+        write_char(writer, '+');
+    }
+    write_u32(writer, value < 0 ? -(u32)value : (u32)value);
+}
+
+// writes "0x" followed by lowercase hex digits, matching printf's "0x%x"
+void write_hex(Writer *writer, u32 value) {
+    static const char hex_digits[] = "0123456789abcdef";
+    char digits[8];
+    u32 n = 0;
+    do {
+        digits[n++] = hex_digits[value & 0xf];
+        value >>= 4;
+    } while (value);
+
+    char *dest = reserve(writer, n + 2);
+    dest[0] = '0';
+    dest[1] = 'x';
+    for (u32 i = 0; i < n; i++) {
+        dest[i + 2] = digits[n - 1 - i];
+    }
+    writer->count += n + 2;
+}
+
+// printf style formatting for output that is not on a hot path
+void write_format(Writer *writer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    u32 available = writer->capacity - writer->count;
+    int n = vsnprintf(writer->data + writer->count, available, format, args);
+    va_end(args);
+
+    if (n < 0) {
+        return;
+    }
+    if ((u32)n >= available) {
+        flush_writer(writer);
+        va_start(args, format);
+        n = vsnprintf(writer->data, writer->capacity, format, args);
+        va_end(args);
+        if ((u32)n >= writer->capacity) n = writer->capacity - 1; // truncated
+    }
+    writer->count += n;
 }
 
-void print_operand(Instruction* inst, u8 operand_num, FILE* dest) {
-    Operand operand = inst->operands[operand_num];
-    OperandType type = operand.kind;
-    switch (type) {
+// ===================================== Instructions ===================================== //
+
+void write_operand(Writer *writer, Instruction* inst, u8 operand_num) {
+    Operand *operand = &inst->operands[operand_num];
+    switch (operand->kind) {
         case OperandRegister: {
-            RegisterAccess reg = operand.reg;
-            fprintf(dest, "%s", get_reg_name(reg.index, (reg.count == 2) ? 2 : reg.offset));
+            RegisterAccess reg = operand->reg;
+            write_string(writer, reg_names[reg.index][(reg.count == 2) ? 2 : reg.offset]);
             break;
         }
         case OperandMemory: {
-            u32 wide = inst->flags & FlagWide;
-            EffectiveAddress address = operand.address;
+            EffectiveAddress *address = &operand->address;
             if (inst->operands[0].kind != OperandRegister) {
-                fprintf(dest, "%s ", wide ? "word" : "byte");
+                if (inst->flags & FlagWide) write_bytes(writer, "word ", 5);
+                else write_bytes(writer, "byte ", 5);
             }
-            fprintf(dest, "[%s", get_effective_address_base_name(address));
-            if (address.base == Ea_direct) {
-                fprintf(dest, "%d", address.displacement);
-            } else if (address.displacement != 0) {
-                fprintf(dest, "%+d", address.displacement);
+            write_char(writer, '[');
+            write_string(writer, rm_base[address->base]);
+            if (address->base == Ea_direct) {
+                write_i32(writer, address->displacement, false);
+            } else if (address->displacement != 0) {
+                write_i32(writer, address->displacement, true);
             }
-            fprintf(dest, "]");
+            write_char(writer, ']');
             break;
         }
         case OperandImmediate: {
-            fprintf(dest, "%d", operand.immediate);
+            write_i32(writer, (i32)operand->immediate, false);
             break;
         }
         case OperandRelativeImmediate: {
-            fprintf(dest, "%+d", operand.s_immediate);
+            write_i32(writer, operand->s_immediate, true);
             break;
         }
         default:
-            fprintf(stderr, "ERROR: unknown operand encountered.\n");
-            exit(1);
+            fatal("unknown operand encountered.");
     };
 }
 
-void print_instruction(Instruction* inst, FILE *dest) {
-    fprintf(dest, "%s ", get_mnemonic(inst->op));
-    print_operand(inst, 0, dest);
+void write_instruction(Writer *writer, Instruction* inst) {
+    if (inst->flags & FlagRep) {
+        write_bytes(writer, "rep ", 4);
+    }
+    write_string(writer, mnemonics[inst->op]);
+    if (inst->op >= OpMovs && inst->op <= OpLods) {
+        write_char(writer, inst->flags & FlagWide ? 'w' : 'b');
+    }
+    if (inst->operands[0].kind == OperandNone) {
+        return;
+    }
+    write_char(writer, ' ');
+    write_operand(writer, inst, 0);
     if (inst->operands[1].kind != OperandNone) {
-        fprintf(dest, ", ");
-        print_operand(inst, 1, dest);
+        write_bytes(writer, ", ", 2);
+        write_operand(writer, inst, 1);
     }
 }
 
-void print_registers(u16 reg_state[], u32 ip, FILE *dest) {
+void write_registers(Writer *writer, u16 reg_state[], u32 ip) {
     for (int i = 1; i < Reg_count; i++) {
-        fprintf(dest, "%8s: 0x%04x (%u)\n", get_reg_name(i, 2), reg_state[i], reg_state[i]);
+        write_format(writer, "%8s: 0x%04x (%u)\n", reg_names[i][2].data, reg_state[i], reg_state[i]);
+    }
+    write_format(writer, "%8s: 0x%04x (%u)\n", "ip", ip, ip);
+}
+
+// writes the set flags as letters, e.g. "CPZ"
+void write_flag_letters(Writer *writer, u16 flags) {
+    static const struct { Flag flag; char letter; } letters[] = {
+            { Carry_flag, 'C' },
+            { Parity_flag, 'P' },
+            { Aux_carry_flag, 'A' },
+            { Zero_flag, 'Z' },
+            { Sign_flag, 'S' },
+            { Overflow_flag, 'O' },
+    };
+    for (u32 i = 0; i < len(letters); i++) {
+        if (flags & letters[i].flag) write_char(writer, letters[i].letter);
+    }
+}
+
+void write_flags(Writer *writer, u16 flags) {
+    write_format(writer, "%8s: ", "flags");
+    write_flag_letters(writer, flags);
+    write_char(writer, '\n');
+}
+
+// ======================================== Errors ======================================== //
+
+// set by batch workers so an error abandons the current file instead of the whole process
+__thread jmp_buf *fatal_jump = NULL;
+
+// reports an error on stderr as "ERROR: ..." and stops the current run
+void fatal(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "ERROR: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+
+    if (fatal_jump) {
+        longjmp(*fatal_jump, 1);
     }
-    fprintf(dest, "%8s: 0x%04x (%u)\n", "ip", ip, ip);
+    exit(1);
 }
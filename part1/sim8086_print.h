@@ -1,7 +1,20 @@
 #ifndef PERF_AWARE_SIM8086_PRINT_H
 #define PERF_AWARE_SIM8086_PRINT_H
 
-void print_instruction(Instruction* inst, FILE *dest);
-void print_registers(u16 reg_state[], u32 ip, FILE *dest);
+void flush_writer(Writer *writer);
+void write_bytes(Writer *writer, const char *data, u32 count);
+void write_string(Writer *writer, String string);
+void write_char(Writer *writer, char c);
+void write_u32(Writer *writer, u32 value);
+void write_i32(Writer *writer, i32 value, bool always_sign);
+void write_hex(Writer *writer, u32 value);
+void write_format(Writer *writer, const char *format, ...);
+void write_instruction(Writer *writer, Instruction* inst);
+void write_registers(Writer *writer, u16 reg_state[], u32 ip);
+void write_flag_letters(Writer *writer, u16 flags);
+void write_flags(Writer *writer, u16 flags);
+
+void fatal(const char *format, ...);
+extern __thread jmp_buf *fatal_jump;
 
 #endif
@@ -0,0 +1,109 @@
+#include "sim8086.h"
+#include "sim8086_print.h"
+#include "sim8086_exec.h"
+#include "sim8086_profile.h"
+
+#define MAX_PROFILE_LINES 32
+
+typedef struct {
+    u32 offset;     // from code_start
+    u64 clocks;
+} ProfileLine;
+
+void begin_profile(Sim8086* sim) {
+    free(sim->profile);
+    sim->profile = calloc(sim->code_end - sim->code_start, sizeof(ProfileEntry));
+    if (!sim->profile && sim->code_end > sim->code_start) {
+        fatal("unable to allocate profile");
+    }
+    sim->profile_clocks = 0;
+    sim->profile_outside = (ProfileEntry){ 0 };
+}
+
+void profile_instruction(Sim8086* sim, Instruction* inst, u32 clocks, bool taken) {
+    ProfileEntry *entry = &sim->profile_outside;
+    if (inst->address >= sim->code_start && inst->address < sim->code_end) {
+        entry = &sim->profile[inst->address - sim->code_start];
+        if (!entry->hits) {
+            entry->inst = *inst;
+        }
+    }
+    entry->hits++;
+    entry->clocks += clocks;
+    entry->taken += taken;
+    sim->profile_clocks += clocks;
+}
+
+static f64 percent(Sim8086* sim, u64 clocks) {
+    return sim->profile_clocks ? 100.0 * (f64)clocks / (f64)sim->profile_clocks : 0.0;
+}
+
+static int compare_clocks(const void* a, const void* b) {
+    const ProfileLine *line_a = a;
+    const ProfileLine *line_b = b;
+    if (line_a->clocks != line_b->clocks) return line_a->clocks < line_b->clocks ? 1 : -1;
+    return line_a->offset < line_b->offset ? -1 : 1;
+}
+
+// lists executed addresses by the clocks spent on them, then every loop closed by a taken
+// backward jump with the clocks of the instructions between its target and the jump
+void print_profile(Sim8086* sim) {
+    Writer *out = &sim->out;
+    ProfileEntry *profile = sim->profile;
+    u32 size = sim->code_end - sim->code_start;
+    ProfileLine *sorted = malloc(size * sizeof(ProfileLine));
+    u32 count = 0;
+    for (u32 i = 0; i < size; i++) {
+        if (profile[i].hits) sorted[count++] = (ProfileLine){ i, profile[i].clocks };
+    }
+    qsort(sorted, count, sizeof(ProfileLine), compare_clocks);
+
+    write_char(out, '\n');
+    write_format(out, "Profile: %lu clocks over %u addresses\n", sim->profile_clocks, count);
+    write_format(out, "%8s %10s %12s %8s  %s\n", "address", "hits", "clocks", "%", "instruction");
+    u32 lines = count < MAX_PROFILE_LINES ? count : MAX_PROFILE_LINES;
+    for (u32 i = 0; i < lines; i++) {
+        u32 address = sim->code_start + sorted[i].offset;
+        ProfileEntry *entry = &profile[sorted[i].offset];
+        write_format(out, "  0x%04x %10lu %12lu %7.2f%%  ", address, entry->hits, entry->clocks, percent(sim, entry->clocks));
+        write_instruction(out, &entry->inst);
+        write_char(out, '\n');
+    }
+    if (count > lines) {
+        write_format(out, "  ... %u more\n", count - lines);
+    }
+    if (sim->profile_outside.hits) {
+        ProfileEntry *outside = &sim->profile_outside;
+        write_format(out, "  outside image %lu hits, %lu clocks (%.2f%%)\n", outside->hits, outside->clocks,
+                     percent(sim, outside->clocks));
+    }
+
+    write_char(out, '\n');
+    write_format(out, "Loops:\n");
+    bool any_loops = false;
+    for (u32 i = 0; i < size; i++) {
+        if (!profile[i].taken) continue;
+        Instruction inst = profile[i].inst;
+        i32 displacement = inst.operands[0].s_immediate + inst.size;
+        bool relative = inst.operands[0].kind == OperandRelativeImmediate;
+        if ((!is_jump(inst.op) && inst.op != OpJmp) || !relative || displacement > 0) continue;
+
+        u32 target = i + displacement;
+        if (target > i) continue; // jumps out of the image
+        u64 loop_clocks = 0;
+        for (u32 j = target; j < i + inst.size; j++) {
+            loop_clocks += profile[j].clocks;
+        }
+        // every pass through the body ends at the back edge, including the last one, where the
+        // jump is not taken
+        write_format(out, "  0x%04x-0x%04x: %lu back-edge executions (%lu taken), %lu clocks (%.2f%%), "
+                     "%.1f clocks/execution\n", sim->code_start + target, sim->code_start + i + inst.size,
+                     profile[i].hits, profile[i].taken, loop_clocks, percent(sim, loop_clocks),
+                     (f64)loop_clocks / (f64)profile[i].hits);
+        any_loops = true;
+    }
+    if (!any_loops) {
+        write_format(out, "  none\n");
+    }
+    free(sorted);
+}
@@ -0,0 +1,8 @@
+#ifndef PERF_AWARE_SIM8086_PROFILE_H
+#define PERF_AWARE_SIM8086_PROFILE_H
+
+void begin_profile(Sim8086* sim);
+void profile_instruction(Sim8086* sim, Instruction* inst, u32 clocks, bool taken);
+void print_profile(Sim8086* sim);
+
+#endif
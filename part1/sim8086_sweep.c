@@ -0,0 +1,197 @@
+#include "sim8086.h"
+#include "sim8086_decode.h"
+#include "sim8086_print.h"
+#include "sim8086_sweep.h"
+
+#include <pthread.h>
+
+#define MIN_SWEEP_CHUNK (64*1024)
+#define CHUNKS_PER_THREAD 4
+#define NO_INDEX 0xffffffff
+
+// instruction length is only known once an instruction is decoded, so a linear sweep can not
+// simply be split between threads. instead every chunk is decoded from each offset the real
+// stream could enter it at; those paths almost always fall into step within a few instructions,
+// after which they share the instructions already decoded. once every chunk is done, the exit
+// of each chunk's real path picks the entry of the next, and the paths taken are copied out
+
+// decodes a chunk from start + offset until it leaves the chunk, fails, or reaches an address
+// an earlier path has already decoded
+static void decode_path(Sweep* sweep, SweepChunk* chunk, u32 offset) {
+    SweepPath *path = &chunk->paths[offset];
+    path->first = chunk->pool_count;
+    u32 address = chunk->start + offset;
+    while (address < chunk->end) {
+        u32 *index = &chunk->index_at[address - chunk->start];
+        if (*index != NO_INDEX) {
+            path->merged = true;
+            break;
+        }
+        Instruction *inst = &chunk->pool[chunk->pool_count];
+        if (!try_decode(sweep->buffer, address, inst) || address + inst->size > sweep->end) {
+            path->failed = true;
+            break;
+        }
+        *index = chunk->pool_count++;
+        address += inst->size;
+    }
+    path->count = chunk->pool_count - path->first;
+    path->exit = address;
+}
+
+static void decode_chunk(Sweep* sweep, SweepChunk* chunk) {
+    u32 size = chunk->end - chunk->start;
+    memset(chunk->index_at, 0xff, size * sizeof(u32));
+    for (u32 offset = 0; offset < chunk->path_count; offset++) {
+        decode_path(sweep, chunk, offset);
+    }
+}
+
+static SweepPath* path_containing(SweepChunk* chunk, u32 index) {
+    for (u32 i = 0; i < chunk->path_count; i++) {
+        SweepPath *path = &chunk->paths[i];
+        if (index >= path->first && index < path->first + path->count) return path;
+    }
+    assert(false);
+    return NULL;
+}
+
+// follows the stream entering the chunk at chunk->entry through every path it merges into,
+// either counting its instructions or copying them to insts. returns the exit of the last path
+static SweepPath* follow_stream(SweepChunk* chunk, Instruction* insts, u32* count) {
+    SweepPath *path = &chunk->paths[chunk->entry - chunk->start];
+    u32 index = path->first;
+    *count = 0;
+    for (;;) {
+        u32 n = path->first + path->count - index;
+        if (insts) {
+            memcpy(insts + *count, chunk->pool + index, n * sizeof(Instruction));
+        }
+        *count += n;
+        if (!path->merged) {
+            return path;
+        }
+        index = chunk->index_at[path->exit - chunk->start];
+        path = path_containing(chunk, index);
+    }
+}
+
+static void* decode_worker(void* arg) {
+    Sweep *sweep = arg;
+    u32 index;
+    while ((index = __atomic_fetch_add(&sweep->next, 1, __ATOMIC_RELAXED)) < sweep->chunk_count) {
+        decode_chunk(sweep, &sweep->chunks[index]);
+    }
+    return NULL;
+}
+
+static void* copy_worker(void* arg) {
+    Sweep *sweep = arg;
+    u32 index;
+    while ((index = __atomic_fetch_add(&sweep->next, 1, __ATOMIC_RELAXED)) < sweep->chunk_count) {
+        SweepChunk *chunk = &sweep->chunks[index];
+        u32 count;
+        follow_stream(chunk, sweep->insts + chunk->output, &count);
+    }
+    return NULL;
+}
+
+static void run_workers(Sweep* sweep, u32 threads, void* (*worker)(void*)) {
+    sweep->next = 0;
+    if (threads > sweep->chunk_count) {
+        threads = sweep->chunk_count;
+    }
+    if (threads <= 1) {
+        worker(sweep);
+        return;
+    }
+    pthread_t *handles = malloc(threads * sizeof(pthread_t));
+    for (u32 i = 0; i < threads; i++) {
+        if (pthread_create(&handles[i], NULL, worker, sweep) != 0) {
+            fatal("unable to start sweep thread");
+        }
+    }
+    for (u32 i = 0; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    free(handles);
+}
+
+// decodes [start, end) of buffer into insts, which must have room for end - start instructions,
+// giving the same stream as decoding one instruction after another. returns the number decoded;
+// stop is set to end, or to the address of an instruction that is invalid or runs past end
+u32 sweep_decode(const u8 buffer[], u32 start, u32 end, u32 threads, Instruction insts[], u32* stop) {
+    u32 size = end - start;
+    u32 chunk_count = size / MIN_SWEEP_CHUNK;
+    if (chunk_count > threads * CHUNKS_PER_THREAD) chunk_count = threads * CHUNKS_PER_THREAD;
+    if (chunk_count == 0) chunk_count = 1;
+    u32 chunk_size = size / chunk_count;
+
+    // one pool and index for the whole image, sliced between the chunks. paths never decode
+    // the same address twice, so a chunk holds at most one instruction per byte plus those of
+    // paths starting past its end
+    Sweep sweep = { buffer, end, calloc(chunk_count, sizeof(SweepChunk)), chunk_count, 0, insts };
+    Instruction *pool = malloc((size + chunk_count * MAX_INSTRUCTION_SIZE) * sizeof(Instruction));
+    u32 *index_at = malloc((size + chunk_count) * sizeof(u32));
+    if (!sweep.chunks || !pool || !index_at) {
+        fatal("unable to allocate sweep");
+    }
+    for (u32 i = 0; i < chunk_count; i++) {
+        SweepChunk *chunk = &sweep.chunks[i];
+        chunk->start = start + i * chunk_size;
+        chunk->end = i + 1 < chunk_count ? chunk->start + chunk_size : end;
+        chunk->path_count = i ? MAX_INSTRUCTION_SIZE : 1; // the image starts on an instruction
+        chunk->pool = pool + (chunk->start - start) + i * MAX_INSTRUCTION_SIZE;
+        chunk->index_at = index_at + (chunk->start - start) + i;
+    }
+    run_workers(&sweep, threads, decode_worker);
+
+    // the chunks are at least MIN_SWEEP_CHUNK bytes, so a stream leaving one always enters the next
+    u32 entry = start;
+    u32 total = 0;
+    u32 used = chunk_count;
+    *stop = end;
+    for (u32 i = 0; i < chunk_count; i++) {
+        SweepChunk *chunk = &sweep.chunks[i];
+        assert(entry - chunk->start < chunk->path_count);
+        chunk->entry = entry;
+        chunk->output = total;
+        SweepPath *last = follow_stream(chunk, NULL, &chunk->count);
+        total += chunk->count;
+        entry = last->exit;
+        if (last->failed) {
+            *stop = last->exit;
+            used = i + 1;
+            break;
+        }
+    }
+    sweep.chunk_count = used;
+    run_workers(&sweep, threads, copy_worker);
+
+    free(index_at);
+    free(pool);
+    free(sweep.chunks);
+    return total;
+}
+
+// disassembles the loaded image like run() does, decoding it on the given number of threads
+void run_sweep(Sim8086* sim, u32 threads) {
+    u32 size = sim->code_end - sim->code_start;
+    Instruction *insts = malloc((size ? size : 1) * sizeof(Instruction));
+    if (!insts) {
+        fatal("unable to allocate sweep output");
+    }
+    u32 stop;
+    u32 count = sweep_decode(sim->memory, sim->code_start, sim->code_end, threads, insts, &stop);
+    for (u32 i = 0; i < count; i++) {
+        write_instruction(&sim->out, &insts[i]);
+        write_char(&sim->out, '\n');
+    }
+    free(insts);
+
+    if (stop != sim->code_end) {
+        decode(sim->memory, stop); // reports an invalid instruction
+        fatal("instruction exceeds disassembly region.");
+    }
+    flush_writer(&sim->out);
+}
@@ -0,0 +1,7 @@
+#ifndef PERF_AWARE_SIM8086_SWEEP_H
+#define PERF_AWARE_SIM8086_SWEEP_H
+
+u32 sweep_decode(const u8 buffer[], u32 start, u32 end, u32 threads, Instruction insts[], u32* stop);
+void run_sweep(Sim8086* sim, u32 threads);
+
+#endif
@@ -0,0 +1,360 @@
+#include "sim8086.h"
+#include "sim8086_exec.h"
+#include "sim8086_timing.h"
+
+#define BUS_CYCLE_CLOCKS 4
+#define QUEUE_SIZE_8086 6
+#define QUEUE_SIZE_8088 4
+
+// clocks from the 8086 manual, indexed by op and operand form. jumps are listed as not taken,
+// with get_taken_clocks giving the extra cost of taking them. where the manual gives a range
+// (mul, div) the lowest figure is used, for byte operands; see wide_clocks
+static const ClockEntry clock_table[OpCount][FormCount] = {
+        [OpMov] = {
+                [FormRegReg] = { 2, 0 },
+                [FormRegMem] = { 8, 1 },
+                [FormMemReg] = { 9, 1 },
+                [FormRegImm] = { 4, 0 },
+                [FormMemImm] = { 10, 1 },
+                [FormAccImm] = { 4, 0 },
+                [FormAccMem] = { 10, 1 },
+                [FormMemAcc] = { 10, 1 },
+        },
+        [OpAdd ... OpSub] = {
+                [FormRegReg] = { 3, 0 },
+                [FormRegMem] = { 9, 1 },
+                [FormMemReg] = { 16, 2 },
+                [FormRegImm] = { 4, 0 },
+                [FormMemImm] = { 17, 2 },
+                [FormAccImm] = { 4, 0 },
+        },
+        [OpAdc ... OpSbb] = {
+                [FormRegReg] = { 3, 0 },
+                [FormRegMem] = { 9, 1 },
+                [FormMemReg] = { 16, 2 },
+                [FormRegImm] = { 4, 0 },
+                [FormMemImm] = { 17, 2 },
+                [FormAccImm] = { 4, 0 },
+        },
+        [OpCmp] = {
+                [FormRegReg] = { 3, 0 },
+                [FormRegMem] = { 9, 1 },
+                [FormMemReg] = { 9, 1 },
+                [FormRegImm] = { 4, 0 },
+                [FormMemImm] = { 10, 1 },
+                [FormAccImm] = { 4, 0 },
+        },
+        [OpXor] = {
+                [FormRegReg] = { 3, 0 },
+                [FormRegMem] = { 9, 1 },
+                [FormMemReg] = { 16, 2 },
+                [FormRegImm] = { 4, 0 },
+                [FormMemImm] = { 17, 2 },
+                [FormAccImm] = { 4, 0 },
+        },
+        [OpAnd ... OpOr] = {
+                [FormRegReg] = { 3, 0 },
+                [FormRegMem] = { 9, 1 },
+                [FormMemReg] = { 16, 2 },
+                [FormRegImm] = { 4, 0 },
+                [FormMemImm] = { 17, 2 },
+                [FormAccImm] = { 4, 0 },
+        },
+        [OpTest] = {
+                [FormRegReg] = { 3, 0 },
+                [FormRegMem] = { 9, 1 },
+                [FormMemReg] = { 9, 1 },
+                [FormRegImm] = { 5, 0 },
+                [FormMemImm] = { 11, 1 },
+                [FormAccImm] = { 4, 0 },
+        },
+        [OpInc ... OpDec] = {
+                [FormReg] = { 2, 0 },
+                [FormMem] = { 15, 2 },
+        },
+        [OpNot ... OpNeg] = {
+                [FormReg] = { 3, 0 },
+                [FormMem] = { 16, 2 },
+        },
+        // shifts and rotates by cl also pay 4 clocks per bit
+        [OpShl ... OpShr] = {
+                [FormRegImm] = { 2, 0 },
+                [FormMemImm] = { 15, 2 },
+                [FormRegReg] = { 8, 0 },
+                [FormMemReg] = { 20, 2 },
+        },
+        [OpSar ... OpRcr] = {
+                [FormRegImm] = { 2, 0 },
+                [FormMemImm] = { 15, 2 },
+                [FormRegReg] = { 8, 0 },
+                [FormMemReg] = { 20, 2 },
+        },
+        [OpMul] = { [FormReg] = { 70, 0 }, [FormMem] = { 76, 1 } },
+        [OpImul] = { [FormReg] = { 80, 0 }, [FormMem] = { 86, 1 } },
+        [OpDiv] = { [FormReg] = { 80, 0 }, [FormMem] = { 86, 1 } },
+        [OpIdiv] = { [FormReg] = { 101, 0 }, [FormMem] = { 107, 1 } },
+        [OpCbw] = { [FormNone] = { 2, 0 } },
+        [OpCwd] = { [FormNone] = { 5, 0 } },
+        [OpPush] = { [FormReg] = { 11, 1 }, [FormMem] = { 16, 2 } },
+        [OpPop] = { [FormReg] = { 8, 1 }, [FormMem] = { 17, 2 } },
+        // repeated string ops take 9 clocks plus get_repeat_clocks instead
+        [OpMovs] = { [FormNone] = { 18, 2 } },
+        [OpStos] = { [FormNone] = { 11, 1 } },
+        [OpLods] = { [FormNone] = { 12, 1 } },
+        [OpCall] = { [FormNone] = { 19, 1 }, [FormReg] = { 16, 1 }, [FormMem] = { 21, 2 } },
+        [OpJmp] = { [FormNone] = { 15, 0 }, [FormReg] = { 11, 0 }, [FormMem] = { 18, 1 } },
+        [OpRet] = { [FormNone] = { 8, 1 }, [FormImm] = { 12, 1 } },
+        [OpJe ... OpJns] = { [FormNone] = { 4, 0 } },
+        [OpLoop] = { [FormNone] = { 5, 0 } },
+        [OpLoopz] = { [FormNone] = { 6, 0 } },
+        [OpLoopnz] = { [FormNone] = { 5, 0 } },
+        [OpJcxz] = { [FormNone] = { 6, 0 } },
+};
+
+// extra clocks for the 16-bit forms of mul and div
+static const u8 wide_clocks[OpCount] = {
+        [OpMul] = 48,
+        [OpImul] = 48,
+        [OpDiv] = 64,
+        [OpIdiv] = 64,
+};
+
+static OperandForm get_form(Instruction* inst) {
+    Operand *dest = &inst->operands[0];
+    Operand *src = &inst->operands[1];
+    bool dest_acc = dest->kind == OperandRegister && dest->reg.index == Reg_a && dest->reg.offset == 0;
+
+    switch (dest->kind) {
+        case OperandRegister:
+            switch (src->kind) {
+                case OperandNone: return FormReg;
+                case OperandRegister: return FormRegReg;
+                // shifts and rotates have no accumulator form
+                case OperandImmediate: return dest_acc && clock_table[inst->op][FormAccImm].clocks ? FormAccImm : FormRegImm;
+                case OperandMemory:
+                    if (inst->op == OpMov && dest_acc && src->address.base == Ea_direct) {
+                        return FormAccMem;
+                    }
+                    return FormRegMem;
+                default: return FormNone;
+            }
+        case OperandMemory:
+            switch (src->kind) {
+                case OperandNone: return FormMem;
+                case OperandImmediate: return FormMemImm;
+                case OperandRegister:
+                    if (inst->op == OpMov && src->reg.index == Reg_a && src->reg.offset == 0 && dest->address.base == Ea_direct) {
+                        return FormMemAcc;
+                    }
+                    return FormMemReg;
+                default: return FormNone;
+            }
+        case OperandImmediate:
+            return FormImm;
+        default:
+            return FormNone;
+    }
+}
+
+static Operand* get_memory_operand(Instruction* inst) {
+    if (inst->operands[0].kind == OperandMemory) return &inst->operands[0];
+    if (inst->operands[1].kind == OperandMemory) return &inst->operands[1];
+    return NULL;
+}
+
+static u32 get_ea_clocks(EffectiveAddress* ea) {
+    switch (ea->base) {
+        case Ea_direct:
+            return 6;
+        case Ea_bx:
+        case Ea_bp:
+        case Ea_si:
+        case Ea_di:
+            return ea->displacement ? 9 : 5;
+        case Ea_bp_di:
+        case Ea_bx_si:
+            return ea->displacement ? 11 : 7;
+        default:
+            return ea->displacement ? 12 : 8;
+    }
+}
+
+// base and effective address clocks, which only depend on the instruction itself
+u32 get_static_clocks(Instruction* inst) {
+    OpType op = inst->op;
+    u32 res = clock_table[op][get_form(inst)].clocks;
+    if ((op == OpInc || op == OpDec) && inst->operands[0].kind == OperandRegister && !(inst->flags & FlagWide)) {
+        res++; // 8-bit register forms take 3 clocks
+    }
+    if (inst->flags & FlagWide) {
+        res += wide_clocks[op];
+    }
+    if (inst->flags & FlagRep) {
+        res = 9;
+    }
+    Operand *memory_operand = get_memory_operand(inst);
+    if (memory_operand) {
+        res += get_ea_clocks(&memory_operand->address);
+    }
+    return res;
+}
+
+u32 get_transfer_penalty(u32 address, u32 transfers) {
+    return (is_8088 || (address & 1)) ? BUS_CYCLE_CLOCKS * transfers : 0;
+}
+
+static bool is_string(OpType op) {
+    return op >= OpMovs && op <= OpLods;
+}
+
+static u32 get_shift_clocks(Sim8086* sim, Instruction* inst) {
+    bool shift = inst->op == OpShl || inst->op == OpShr || (inst->op >= OpSar && inst->op <= OpRcr);
+    bool by_cl = shift && inst->operands[1].kind == OperandRegister;
+    return by_cl ? 4 * (sim->reg_state[Reg_c] & 0xff) : 0;
+}
+
+static u32 get_repeat_clocks(Sim8086* sim, Instruction* inst) {
+    if (!(inst->flags & FlagRep)) {
+        return 0;
+    }
+    u32 per_repeat = inst->op == OpMovs ? 17 : inst->op == OpStos ? 10 : 13;
+    return per_repeat * sim->reg_state[Reg_c];
+}
+
+// string ops transfer at si and/or di and stack ops at sp. every repetition of a string op pays
+static u32 get_penalty_clocks(Sim8086* sim, Instruction* inst) {
+    OpType op = inst->op;
+    u32 transfers = clock_table[op][get_form(inst)].transfers;
+    if (!transfers || !(inst->flags & FlagWide || op == OpRet || op == OpCall)) {
+        return 0;
+    }
+    Operand *memory_operand = get_memory_operand(inst);
+    u32 address;
+    if (memory_operand && (op == OpPush || op == OpPop || op == OpCall)) {
+        // one transfer at the operand and one on the stack, each paying for its own alignment
+        return get_transfer_penalty(get_memory_address(sim, &memory_operand->address), 1) +
+               get_transfer_penalty(sim->reg_state[Reg_sp], transfers - 1);
+    } else if (memory_operand) {
+        address = get_memory_address(sim, &memory_operand->address);
+    } else if (is_string(op)) {
+        u32 repeats = inst->flags & FlagRep ? sim->reg_state[Reg_c] : 1;
+        if (op == OpMovs) {
+            // reads at si and writes at di, so each side pays for its own alignment
+            return get_transfer_penalty(sim->reg_state[Reg_si], repeats) +
+                   get_transfer_penalty(sim->reg_state[Reg_di], repeats);
+        }
+        address = op == OpStos ? sim->reg_state[Reg_di] : sim->reg_state[Reg_si];
+        transfers *= repeats;
+    } else {
+        address = sim->reg_state[Reg_sp];
+    }
+    return get_transfer_penalty(address, transfers);
+}
+
+// clocks that depend on the machine state before the instruction runs: bus penalties for
+// word transfers and the per bit cost of shifting by cl or per repetition of a string op
+u32 get_dynamic_clocks(Sim8086* sim, Instruction* inst) {
+    return get_shift_clocks(sim, inst) + get_repeat_clocks(sim, inst) + get_penalty_clocks(sim, inst);
+}
+
+// times an instruction about to run against the current machine state; jumps are timed as
+// not taken, see get_taken_clocks
+Timing get_timing(Sim8086* sim, Instruction* inst) {
+    Timing timing = { 0 };
+    Operand *memory_operand = get_memory_operand(inst);
+    if (memory_operand) {
+        timing.ea = get_ea_clocks(&memory_operand->address);
+    }
+    timing.base = get_static_clocks(inst) - timing.ea + get_shift_clocks(sim, inst) + get_repeat_clocks(sim, inst);
+    timing.penalty = get_penalty_clocks(sim, inst);
+    return timing;
+}
+
+// extra clocks for a jump that is taken
+u32 get_taken_clocks(OpType op) {
+    switch (op) {
+        case OpJe ... OpJns:
+        case OpLoop:
+        case OpLoopz:
+        case OpJcxz:
+            return 12;
+        case OpLoopnz:
+            return 14;
+        default:
+            return 0;
+    }
+}
+
+// ===================================== Prefetch Queue ===================================== //
+
+// the manual's clocks assume instruction bytes are always waiting in the queue. this models
+// the BIU filling the queue whenever the EU leaves the bus idle, so code that outruns its
+// instruction fetch (short instructions, taken jumps, heavy memory traffic) pays for it
+
+void reset_prefetch_queue(Sim8086* sim, u32 address) {
+    PrefetchQueue *queue = &sim->queue;
+    queue->fetch_address = address;
+    queue->count = 0;
+    queue->progress = 0;
+}
+
+// completes a fetch bus cycle, unless the queue has no room for what it would bring in.
+// the 8086 fetches aligned words, the 8088 single bytes
+static bool fetch_into_queue(PrefetchQueue* queue) {
+    u32 capacity = is_8088 ? QUEUE_SIZE_8088 : QUEUE_SIZE_8086;
+    u32 bytes = (is_8088 || (queue->fetch_address & 1)) ? 1 : 2;
+    if (queue->count + bytes > capacity) {
+        return false;
+    }
+    queue->count += bytes;
+    queue->fetch_address += bytes;
+    return true;
+}
+
+// gives the BIU clocks of free bus time
+static void fill_queue(PrefetchQueue* queue, u32 clocks) {
+    queue->progress += clocks;
+    while (queue->progress >= BUS_CYCLE_CLOCKS) {
+        if (!fetch_into_queue(queue)) {
+            queue->progress = 0; // full, the BIU idles
+            return;
+        }
+        queue->progress -= BUS_CYCLE_CLOCKS;
+    }
+}
+
+static u32 get_bus_clocks(Instruction* inst, Timing timing) {
+    return BUS_CYCLE_CLOCKS * clock_table[inst->op][get_form(inst)].transfers + timing.penalty;
+}
+
+// advances the queue over an instruction that has just run with the given timing, ending at
+// next_ip. returns the clocks the EU stalled waiting for the instruction's bytes
+u32 prefetch_instruction(Sim8086* sim, Instruction* inst, Timing timing, u32 next_ip) {
+    PrefetchQueue *queue = &sim->queue;
+    if (queue->fetch_address - queue->count != inst->address) {
+        reset_prefetch_queue(sim, inst->address);
+    }
+
+    // the EU takes bytes as they arrive, so instructions longer than the queue still decode
+    u32 wait = 0;
+    u32 needed = inst->size;
+    for (;;) {
+        u32 available = queue->count < needed ? queue->count : needed;
+        queue->count -= available;
+        needed -= available;
+        if (!needed) break;
+        wait += BUS_CYCLE_CLOCKS - queue->progress;
+        queue->progress = 0;
+        fetch_into_queue(queue);
+    }
+
+    // a taken jump discards the queue and the BIU refills it from the target while the jump
+    // completes; otherwise it fetches ahead whenever the EU is not using the bus
+    if (next_ip != inst->address + inst->size) {
+        reset_prefetch_queue(sim, next_ip);
+    }
+    u32 total = timing_total(timing);
+    u32 bus = get_bus_clocks(inst, timing);
+    fill_queue(queue, total > bus ? total - bus : 0);
+    return wait;
+}
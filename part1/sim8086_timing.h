@@ -0,0 +1,16 @@
+#ifndef PERF_AWARE_SIM8086_TIMING_H
+#define PERF_AWARE_SIM8086_TIMING_H
+
+Timing get_timing(Sim8086* sim, Instruction* inst);
+u32 get_static_clocks(Instruction* inst);
+u32 get_dynamic_clocks(Sim8086* sim, Instruction* inst);
+u32 get_taken_clocks(OpType op);
+u32 get_transfer_penalty(u32 address, u32 transfers);
+void reset_prefetch_queue(Sim8086* sim, u32 address);
+u32 prefetch_instruction(Sim8086* sim, Instruction* inst, Timing timing, u32 next_ip);
+
+static inline u32 timing_total(Timing timing) {
+    return timing.base + timing.ea + timing.penalty + timing.wait;
+}
+
+#endif
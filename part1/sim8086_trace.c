@@ -0,0 +1,349 @@
+#include "sim8086.h"
+#include "sim8086_decode.h"
+#include "sim8086_print.h"
+#include "sim8086_exec.h"
+#include "sim8086_trace.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_VERSION 2
+#define FLAGS_CHANGED 1
+#define WRITE_COUNT_SHIFT 12
+
+// each executed instruction is recorded as the ip it left behind, a u16 whose bit 0 says the
+// flags changed, bits 1-8 which registers changed and bits 12-15 how many memory writes it
+// made, then the new register values, the new flags and for every write its address, size,
+// the bytes it overwrote and the bytes it stored. snapshots of the registers every
+// TRACE_SNAPSHOT_INTERVAL steps let a replay start near any step instead of at the beginning
+
+// ===================================== Recording ====================================== //
+
+static void write_value(Tracer* trace, const void* value, u32 size) {
+    write_bytes(&trace->out, value, size);
+    trace->offset += size;
+}
+
+static void push_snapshot(Sim8086* sim) {
+    Tracer *trace = sim->trace;
+    if (trace->snapshot_count == trace->snapshot_capacity) {
+        trace->snapshot_capacity = trace->snapshot_capacity ? 2 * trace->snapshot_capacity : 64;
+        trace->snapshots = realloc(trace->snapshots,
+                                   trace->snapshot_capacity * sizeof(TraceSnapshot));
+        if (!trace->snapshots) {
+            fatal("unable to allocate trace snapshots");
+        }
+    }
+    TraceSnapshot *snapshot = &trace->snapshots[trace->snapshot_count++];
+    snapshot->step = trace->steps;
+    snapshot->offset = trace->offset;
+    memcpy(snapshot->reg_state, trace->reg_state, sizeof(trace->reg_state));
+    snapshot->flags = trace->flags;
+    snapshot->ip = sim->ip;
+}
+
+// starts recording a run of the program already loaded into sim
+void begin_trace(Sim8086* sim, const char *path) {
+    Tracer *trace = calloc(1, sizeof(Tracer));
+    if (!trace) {
+        fatal("unable to allocate trace");
+    }
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        free(trace);
+        fatal("unable to create %s", path);
+    }
+    char *data = malloc(OUTPUT_BUFFER_SIZE);
+    if (!data) {
+        fatal("unable to allocate trace buffer");
+    }
+    trace->out = (Writer){ trace->file, data, 0, OUTPUT_BUFFER_SIZE };
+    sim->trace = trace;
+
+    TraceHeader header = { "S86T", TRACE_VERSION, sim->code_start, sim->code_end,
+                           TRACE_SNAPSHOT_INTERVAL, 0 };
+    write_value(trace, &header, sizeof(header));
+    write_value(trace, sim->memory + sim->code_start, sim->code_end - sim->code_start);
+
+    memcpy(trace->reg_state, sim->reg_state, sizeof(sim->reg_state));
+    trace->flags = get_flags(sim);
+    push_snapshot(sim);
+}
+
+// notes a write of size bytes at address, before the instruction making it changes anything
+void trace_memory_write(Sim8086* sim, u32 address, u32 size) {
+    Tracer *trace = sim->trace;
+    if (trace->write_count == MAX_TRACE_WRITES) {
+        fatal("more than %u memory writes in one step", MAX_TRACE_WRITES);
+    }
+    TraceWrite *write = &trace->writes[trace->write_count++];
+    write->address = address;
+    write->size = size;
+    if (trace->old_data_size + size > trace->old_data_capacity) {
+        u32 capacity = trace->old_data_capacity ? trace->old_data_capacity : 256;
+        while (capacity < trace->old_data_size + size) capacity *= 2;
+        trace->old_data = realloc(trace->old_data, capacity);
+        if (!trace->old_data) {
+            fatal("unable to allocate trace writes");
+        }
+        trace->old_data_capacity = capacity;
+    }
+    memcpy(trace->old_data + trace->old_data_size, sim->memory + address, size);
+    trace->old_data_size += size;
+}
+
+// records the instruction that has just executed
+void trace_step(Sim8086* sim) {
+    Tracer *trace = sim->trace;
+    u16 flags = get_flags(sim);
+    u16 changed = trace->write_count << WRITE_COUNT_SHIFT;
+    if (flags != trace->flags) changed |= FLAGS_CHANGED;
+    for (u32 i = 1; i < Reg_count; i++) {
+        if (sim->reg_state[i] != trace->reg_state[i]) changed |= 1 << i;
+    }
+
+    write_value(trace, &sim->ip, sizeof(u32));
+    write_value(trace, &changed, sizeof(u16));
+    for (u32 i = 1; i < Reg_count; i++) {
+        if (changed & (1 << i)) {
+            write_value(trace, &sim->reg_state[i], sizeof(u16));
+            trace->reg_state[i] = sim->reg_state[i];
+        }
+    }
+    if (changed & FLAGS_CHANGED) {
+        write_value(trace, &flags, sizeof(u16));
+        trace->flags = flags;
+    }
+    const u8 *old_data = trace->old_data;
+    for (u32 i = 0; i < trace->write_count; i++) {
+        TraceWrite *write = &trace->writes[i];
+        write_value(trace, &write->address, sizeof(u32));
+        write_value(trace, &write->size, sizeof(u32));
+        write_value(trace, old_data, write->size);
+        write_value(trace, sim->memory + write->address, write->size);
+        old_data += write->size;
+    }
+    trace->write_count = 0;
+    trace->old_data_size = 0;
+
+    trace->steps++;
+    if (trace->steps % TRACE_SNAPSHOT_INTERVAL == 0) {
+        push_snapshot(sim);
+    }
+}
+
+// writes the snapshot table and footer and closes the trace
+void end_trace(Sim8086* sim) {
+    Tracer *trace = sim->trace;
+    // records have no alignment, the table and footer are read in place so they get it back
+    static const u8 padding[8] = { 0 };
+    write_value(trace, padding, (8 - trace->offset % 8) % 8);
+    TraceFooter footer = { trace->steps, trace->offset, trace->snapshot_count, "S86E" };
+    write_value(trace, trace->snapshots, trace->snapshot_count * sizeof(TraceSnapshot));
+    write_value(trace, &footer, sizeof(footer));
+    flush_writer(&trace->out);
+    fclose(trace->file);
+    free(trace->out.data);
+    free(trace->snapshots);
+    free(trace->old_data);
+    free(trace);
+    sim->trace = NULL;
+}
+
+// ====================================== Replay ======================================= //
+
+static const u8* read_record(const u8* p, TraceRecord* record) {
+    memcpy(&record->ip, p, sizeof(u32));
+    p += sizeof(u32);
+    memcpy(&record->changed, p, sizeof(u16));
+    p += sizeof(u16);
+    for (u32 i = 1; i < Reg_count; i++) {
+        if (record->changed & (1 << i)) {
+            memcpy(&record->reg_state[i], p, sizeof(u16));
+            p += sizeof(u16);
+        }
+    }
+    if (record->changed & FLAGS_CHANGED) {
+        memcpy(&record->flags, p, sizeof(u16));
+        p += sizeof(u16);
+    }
+    record->write_count = record->changed >> WRITE_COUNT_SHIFT;
+    for (u32 i = 0; i < record->write_count; i++) {
+        TraceWrite *write = &record->writes[i];
+        memcpy(&write->address, p, sizeof(u32));
+        memcpy(&write->size, p + sizeof(u32), sizeof(u32));
+        p += 2 * sizeof(u32);
+        write->old_data = p;
+        write->new_data = p + write->size;
+        p += 2 * write->size;
+    }
+    return p;
+}
+
+static void open_replay(Replay* replay, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fatal("unable to open %s", path);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        close(fd);
+        fatal("unable to stat %s", path);
+    }
+    replay->size = (u64)file_stat.st_size;
+    if (replay->size < sizeof(TraceHeader) + sizeof(TraceFooter)) {
+        close(fd);
+        fatal("%s is not a trace", path);
+    }
+    replay->data = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (replay->data == MAP_FAILED) {
+        fatal("unable to map %s", path);
+    }
+
+    replay->header = (const TraceHeader*)replay->data;
+    replay->footer = (const TraceFooter*)(replay->data + replay->size - sizeof(TraceFooter));
+    const TraceHeader *header = replay->header;
+    const TraceFooter *footer = replay->footer;
+    u64 snapshots_size = footer->snapshot_count * sizeof(TraceSnapshot);
+    if (memcmp(header->magic, "S86T", 4) != 0 || header->version != TRACE_VERSION ||
+        memcmp(footer->magic, "S86E", 4) != 0 || footer->snapshot_count == 0 ||
+        footer->snapshot_offset + snapshots_size + sizeof(TraceFooter) != replay->size) {
+        fatal("%s is not a complete trace", path);
+    }
+    replay->snapshots = (const TraceSnapshot*)(replay->data + footer->snapshot_offset);
+
+    replay->memory = calloc(1, MEMORY_SIZE + MEMORY_GUARD_SIZE);
+    replay->records = malloc(header->snapshot_interval * sizeof(TraceRecord));
+    if (!replay->memory || !replay->records) {
+        fatal("unable to allocate replay");
+    }
+    memcpy(replay->memory + header->code_start, replay->data + sizeof(TraceHeader),
+           header->code_end - header->code_start);
+    replay->memory_step = 0;
+    replay->memory_offset = replay->snapshots[0].offset;
+}
+
+static void close_replay(Replay* replay) {
+    munmap((void*)replay->data, replay->size);
+    free(replay->memory);
+    free(replay->records);
+}
+
+// brings memory to its contents before step, applying writes going forward and undoing them
+// going back, one snapshot interval at a time
+static void seek_memory(Replay* replay, u64 step) {
+    TraceRecord record;
+    if (step >= replay->memory_step) {
+        const u8 *p = replay->data + replay->memory_offset;
+        for (u64 i = replay->memory_step; i < step; i++) {
+            p = read_record(p, &record);
+            for (u32 w = 0; w < record.write_count; w++) {
+                TraceWrite *write = &record.writes[w];
+                memcpy(replay->memory + write->address, write->new_data, write->size);
+            }
+        }
+        replay->memory_step = step;
+        replay->memory_offset = p - replay->data;
+        return;
+    }
+
+    u32 interval = replay->header->snapshot_interval;
+    while (replay->memory_step > step) {
+        const TraceSnapshot *snapshot = &replay->snapshots[(replay->memory_step - 1) / interval];
+        u64 first = snapshot->step > step ? snapshot->step : step;
+
+        const u8 *p = replay->data + snapshot->offset;
+        u64 offset = 0;
+        for (u64 i = snapshot->step; i < replay->memory_step; i++) {
+            if (i == first) offset = p - replay->data;
+            p = read_record(p, &replay->records[i - snapshot->step]);
+        }
+        for (u64 i = replay->memory_step; i > first; i--) {
+            TraceRecord *undo = &replay->records[i - 1 - snapshot->step];
+            for (u32 w = undo->write_count; w > 0; w--) {
+                TraceWrite *write = &undo->writes[w - 1];
+                memcpy(replay->memory + write->address, write->old_data, write->size);
+            }
+        }
+        replay->memory_step = first;
+        replay->memory_offset = offset;
+    }
+}
+
+// reconstructs the machine state before step from the nearest snapshot at or before it
+static void seek(Replay* replay, u64 step) {
+    const TraceSnapshot *snapshot = &replay->snapshots[step / replay->header->snapshot_interval];
+    memcpy(replay->reg_state, snapshot->reg_state, sizeof(replay->reg_state));
+    replay->flags = snapshot->flags;
+    replay->ip = snapshot->ip;
+
+    TraceRecord record;
+    const u8 *p = replay->data + snapshot->offset;
+    for (u64 i = snapshot->step; i < step; i++) {
+        p = read_record(p, &record);
+        for (u32 r = 1; r < Reg_count; r++) {
+            if (record.changed & (1 << r)) replay->reg_state[r] = record.reg_state[r];
+        }
+        if (record.changed & FLAGS_CHANGED) replay->flags = record.flags;
+        replay->ip = record.ip;
+    }
+    seek_memory(replay, step);
+}
+
+// the step a replay argument names, or total for "end"
+static u64 parse_step(const char *arg, u64 total) {
+    if (strcmp(arg, "end") == 0) {
+        return total;
+    }
+    char *end;
+    u64 step = strtoull(arg, &end, 0);
+    if (end == arg || *end != '\0' || arg[0] == '-') {
+        fatal("replay step %s is not a number", arg);
+    }
+    return step;
+}
+
+// prints the machine state after each of the given numbers of steps ("end" for the last), as
+// reconstructed from the trace at path without simulating anything
+void replay_trace(const char *path, char *steps[], u32 step_count, Writer* out) {
+    // every step is checked before anything is printed, as fatal drops the buffered output
+    for (u32 i = 0; i < step_count; i++) {
+        parse_step(steps[i], 0);
+    }
+
+    Replay replay = { 0 };
+    open_replay(&replay, path);
+    const TraceHeader *header = replay.header;
+    u64 total = replay.footer->steps;
+    write_format(out, "Trace: %lu steps of 0x%x-0x%x, %u snapshots, %lu bytes\n", total,
+                 header->code_start, header->code_end, replay.footer->snapshot_count, replay.size);
+
+    char *end_only[] = { "end" };
+    if (step_count == 0) {
+        steps = end_only;
+        step_count = 1;
+    }
+    for (u32 i = 0; i < step_count; i++) {
+        u64 step = parse_step(steps[i], total);
+        if (step > total) {
+            write_format(out, "\nStep %lu is past the end of the trace\n", step);
+            continue;
+        }
+        seek(&replay, step);
+
+        write_format(out, "\nAfter step %lu:\n", step);
+        write_registers(out, replay.reg_state, replay.ip);
+        write_flags(out, replay.flags);
+        Instruction inst;
+        if (step < total && try_decode(replay.memory, replay.ip, &inst)) {
+            write_format(out, "%8s: ", "next");
+            write_instruction(out, &inst);
+            write_char(out, '\n');
+        }
+    }
+    flush_writer(out);
+    close_replay(&replay);
+}
@@ -0,0 +1,10 @@
+#ifndef PERF_AWARE_SIM8086_TRACE_H
+#define PERF_AWARE_SIM8086_TRACE_H
+
+void begin_trace(Sim8086* sim, const char *path);
+void trace_memory_write(Sim8086* sim, u32 address, u32 size);
+void trace_step(Sim8086* sim);
+void end_trace(Sim8086* sim);
+void replay_trace(const char *path, char *steps[], u32 step_count, Writer* out);
+
+#endif
@@ -1,22 +1,20 @@
 #include "haversine.h"
+#include <pthread.h>
 #include "haversine_formula.c"
 #include "haversine_clock.c"
+#include "haversine_arena.c"
+#include "haversine_number.c"
 
 #define MAX_IDENT 64            // max allowed length for an identifier in JSON
-#define MAX_JSON_DIGITS 32      // max allowed digits in a given JSON number
 #define MIN_JSON_PAIR_SIZE 24   // min 6 bytes (e.g. '"x0":0') * 4 coordinates == 24 bytes min
 
 // toggle for profiler
 #define PROFILER 1
 #include "haversine_profiler.c"
+#include "haversine_scan.c"
 
 // ====================================== Token Types ===================================== //
 
-typedef struct {
-    size_t count;
-    u8 *data;
-} Buffer;
-
 typedef enum {
     TOKEN_NONE,
 
@@ -93,7 +91,9 @@ typedef struct {
 
 // ======================================= Tokenizer ====================================== //
 
-char *curr_byte;    // pointer to current byte in json input
+// per thread, so each thread can tokenize its own chunk of the input
+__thread char *curr_byte;    // pointer to current byte in json input
+__thread StructuralScanner scanner;  // where each token of the json input starts
 
 void set_identifier(Token *token) {
     // PRE: assume curr_byte is '"' when this function is called; if
@@ -120,44 +120,21 @@ void set_identifier(Token *token) {
 void set_number(Token *token) {
     // PRE: assume curr_byte is a digit or '-' when this function is called;
     // if it isn't, that is a bug in the calling code not this function.
-    char num[MAX_JSON_DIGITS];
-    u32 i = 0;
-
-    if (*curr_byte == '-') {
-        num[i++] = *curr_byte;
-        curr_byte++;
-    }
-
-    while (isdigit(*curr_byte)) {
-        num[i++] = *curr_byte;
-        curr_byte++;
-    }
-
-    if (*curr_byte == '.') {
-        num[i++] = *curr_byte;
-        curr_byte++;
-        if (!isdigit(*curr_byte)) {
-            fprintf(stderr, "PARSING ERROR: malformed number in JSON input\n");
-            exit(1);
-        }
-    }
-
-    while (isdigit(*curr_byte)) {
-        num[i++] = *curr_byte;
-        curr_byte++;
+    const char *end;
+    if (!parse_number(curr_byte, &token->number, &end)) {
+        fprintf(stderr, "PARSING ERROR: malformed number in JSON input\n");
+        exit(1);
     }
-    curr_byte--;
-    num[i] = '\0';
-
-    token->number = atof(num);
+    curr_byte = (char *)end - 1;
 
     // POST: curr_byte is at last char of number string
 }
 
 Token next_token() {
-    while (*curr_byte == ' ' || *curr_byte == '\n' || *curr_byte == '\t') {
-        curr_byte++;
+    while (scanner.index_pos == scanner.index_count) {
+        scan_window(&scanner);
     }
+    curr_byte = (char *)scanner.index[scanner.index_pos++];
 
     Token token = {};
 
@@ -189,6 +166,13 @@ Token next_token() {
             if (c == '-' || isdigit(c)) {
                 token.type = TOKEN_FLOAT;
                 set_number(&token);
+                // the scan indexes only the start of each run of scalar bytes, so whatever of
+                // the run the number leaves would otherwise never be looked at
+                u8 after = (u8)curr_byte[1];
+                if (after != '\0' && !(byte_classes[after] & (CLASS_WHITESPACE | CLASS_OP))) {
+                    fprintf(stderr, "PARSING ERROR: unknown token '%d'\n", after);
+                    exit(1);
+                }
             } else if (c == '\0') {
                 token.type = TOKEN_NONE;
             } else {
@@ -205,10 +189,12 @@ Token next_token() {
 
 // ======================================== Parser ======================================== //
 
+Arena json_arena;   // backs every element of the parsed JSON tree
+
 JsonElement *parse_json_element(Token *token);
 
 JsonDict *parse_dictionary() {
-    JsonDict *res = (JsonDict *) malloc(sizeof(JsonDict));
+    JsonDict *res = (JsonDict *) arena_alloc(&json_arena, sizeof(JsonDict));
 
     Token token = next_token();
     if (token.type == TOKEN_RBRACE) {
@@ -216,7 +202,7 @@ JsonDict *parse_dictionary() {
         return res;
     }
 
-    DictPair *entry = (DictPair *) malloc(sizeof(DictPair));
+    DictPair *entry = (DictPair *) arena_alloc(&json_arena, sizeof(DictPair));
     res->entries = entry;
     while (token.type != TOKEN_RBRACE) {
         if (token.type != TOKEN_IDENTIFIER) {
@@ -237,7 +223,7 @@ JsonDict *parse_dictionary() {
 
         token = next_token();
         if (token.type == TOKEN_COMMA) {
-            entry->next = (DictPair *) malloc(sizeof(DictPair));
+            entry->next = (DictPair *) arena_alloc(&json_arena, sizeof(DictPair));
             entry = entry->next;
             token = next_token();
             if (token.type == TOKEN_RBRACE) {
@@ -253,7 +239,7 @@ JsonDict *parse_dictionary() {
 }
 
 JsonArray *parse_array() {
-    JsonArray *res = (JsonArray *) malloc(sizeof(JsonArray));
+    JsonArray *res = (JsonArray *) arena_alloc(&json_arena, sizeof(JsonArray));
 
     Token token = next_token();
     if (token.type == TOKEN_RBRACKET) {
@@ -261,7 +247,7 @@ JsonArray *parse_array() {
         return res;
     }
 
-    ArrayElement *entry = (ArrayElement *) malloc(sizeof(ArrayElement));
+    ArrayElement *entry = (ArrayElement *) arena_alloc(&json_arena, sizeof(ArrayElement));
     res->entries = entry;
     while (token.type != TOKEN_RBRACKET) {
         entry->value = parse_json_element(&token);
@@ -272,7 +258,7 @@ JsonArray *parse_array() {
                 fprintf(stderr, "PARSING ERROR: unexpected ']' after ','\n");
                 exit(1);
             }
-            entry->next = (ArrayElement *) malloc(sizeof(ArrayElement));
+            entry->next = (ArrayElement *) arena_alloc(&json_arena, sizeof(ArrayElement));
             entry = entry->next;
         } else {
             entry->next = NULL;
@@ -283,7 +269,7 @@ JsonArray *parse_array() {
 }
 
 JsonElement *parse_json_element(Token *token) {
-    JsonElement *res = (JsonElement *) malloc(sizeof(JsonElement));
+    JsonElement *res = (JsonElement *) arena_alloc(&json_arena, sizeof(JsonElement));
 
     switch (token->type) {
         case TOKEN_LBRACE:
@@ -314,7 +300,7 @@ JsonElement *parse_json_element(Token *token) {
 }
 
 JsonElement *parse_json(Buffer input_json) {
-    curr_byte = (char *)input_json.data;
+    begin_scan(&scanner, input_json, select_classifier());
 
     Token token = next_token();
     JsonElement *top_element = parse_json_element(&token);
@@ -322,35 +308,9 @@ JsonElement *parse_json(Buffer input_json) {
     return top_element;
 }
 
-void free_json(JsonElement *json) {
-    switch (json->type) {
-        case ELEM_DICT: {
-            DictPair *curr = json->dict->entries;
-            DictPair *prev = NULL;
-            while (curr != NULL) {
-                prev = curr;
-                curr = curr->next;
-                free_json(prev->value);
-                free(prev);
-            }
-            free(json->dict);
-            break;
-        }
-        case ELEM_ARRAY: {
-            ArrayElement *curr = json->array->entries;
-            ArrayElement *prev = NULL;
-            while (curr != NULL) {
-                prev = curr;
-                curr = curr->next;
-                free_json(prev->value);
-                free(prev);
-            }
-            free(json->array);
-            break;
-        }
-        default: {}
-    }
-    free(json);
+// the whole tree lives in json_arena, so it is released in one go rather than node by node
+void free_json(void) {
+    arena_release(&json_arena);
 }
 
 bool are_equal(Buffer s1, Buffer s2) {
@@ -381,7 +341,8 @@ f64 unwrap_number(JsonElement *number) {
     return number->number;
 }
 
-u64 parse_haversine_pairs(Buffer input_json, Pair *pairs, u64 max_count) {
+// builds the generic JSON tree of the input, then looks the pairs up in it
+u64 parse_dom_haversine_pairs(Buffer input_json, Pair *pairs, u64 max_count) {
     BEGIN_TIME_FUNCTION;
     Buffer pairs_key = { 5, (u8*)("pairs") };
     BEGIN_TIME_BLOCK("parse json");
@@ -414,7 +375,7 @@ u64 parse_haversine_pairs(Buffer input_json, Pair *pairs, u64 max_count) {
     END_TIME_BLOCK("populate pairs_array");
 
     BEGIN_TIME_BLOCK("free");
-    free_json(parsed_json);
+    free_json();
     END_TIME_BLOCK("free");
 
     END_TIME_FUNCTION;
@@ -422,14 +383,356 @@ u64 parse_haversine_pairs(Buffer input_json, Pair *pairs, u64 max_count) {
     return count;
 }
 
+// ================================ Streaming Pair Extractor ============================== //
+
+// the coordinate of pair named by a key, or NULL if the key names none
+f64 *pair_field(Pair *pair, Buffer key) {
+    if (key.count != 2 || (key.data[1] != '0' && key.data[1] != '1')) {
+        return NULL;
+    }
+    bool first = key.data[1] == '0';
+    switch (key.data[0]) {
+        case 'x': return first ? &pair->x0 : &pair->x1;
+        case 'y': return first ? &pair->y0 : &pair->y1;
+        default: return NULL;
+    }
+}
+
+// parses the rest of a pair object, {"x0": f, "y0": f, "x1": f, "y1": f} with the keys in any
+// order, once its opening brace has been read
+bool stream_pair(Pair *pair) {
+    u32 seen = 0;
+    for (u32 i = 0; i < 4; i++) {
+        Token token = next_token();
+        if (token.type != TOKEN_IDENTIFIER) return false;
+        f64 *field = pair_field(pair, token.identifier);
+        if (field == NULL || (seen & (1 << (field - &pair->x0)))) return false;
+        seen |= 1 << (field - &pair->x0);
+        if (next_token().type != TOKEN_COLON) return false;
+        token = next_token();
+        if (token.type != TOKEN_FLOAT) return false;
+        *field = token.number;
+        if (next_token().type != (i < 3 ? TOKEN_COMMA : TOKEN_RBRACE)) return false;
+    }
+    return true;
+}
+
+// parses input laid out as {"pairs": [{"x0": f, "y0": f, "x1": f, "y1": f}, ...]}, with the
+// keys of a pair in any order, straight into pairs as it is tokenized. returns false as soon
+// as the input strays from that layout, leaving the generic parser to make sense of it
+bool stream_haversine_pairs(Buffer input_json, Pair *pairs, u64 max_count, u64 *count) {
+    Buffer pairs_key = { 5, (u8*)("pairs") };
+    begin_scan(&scanner, input_json, select_classifier());
+
+    Token token = next_token();
+    if (token.type != TOKEN_LBRACE) return false;
+    token = next_token();
+    if (token.type != TOKEN_IDENTIFIER || !are_equal(token.identifier, pairs_key)) return false;
+    if (next_token().type != TOKEN_COLON) return false;
+    if (next_token().type != TOKEN_LBRACKET) return false;
+
+    u64 n = 0;
+    token = next_token();
+    while (token.type == TOKEN_LBRACE) {
+        if (n == max_count) return false;
+        if (!stream_pair(pairs + n)) return false;
+        n++;
+
+        token = next_token();
+        if (token.type == TOKEN_COMMA) {
+            token = next_token();
+            if (token.type != TOKEN_LBRACE) return false;
+        } else if (token.type != TOKEN_RBRACKET) {
+            return false;
+        }
+    }
+    if (token.type != TOKEN_RBRACKET) return false;
+    if (next_token().type != TOKEN_RBRACE) return false;
+    if (next_token().type != TOKEN_NONE) return false;
+
+    *count = n;
+    return true;
+}
+
+// ================================ Parallel Pair Extractor =============================== //
+
+#define MAX_THREADS 64
+
+// a run of whole pair objects from the pairs array, parsed on its own thread into its own
+// slice of the pairs
+typedef struct {
+    Buffer chunk;
+    bool last;          // the final chunk, which has no comma after its last pair
+    Pair *pairs;
+    u64 max_count;
+    u64 count;
+    bool parsed;
+    u64 elapsed;        // cpu timer ticks spent parsing the chunk
+} PairChunk;
+
+// parses a chunk of the pairs array: pair objects each followed by a comma, bar the last of
+// the final chunk
+bool stream_pair_chunk(Buffer chunk, bool last, Pair *pairs, u64 max_count, u64 *count) {
+    begin_scan(&scanner, chunk, select_classifier());
+    u64 n = 0;
+    for (;;) {
+        if (n == max_count) return false;
+        if (next_token().type != TOKEN_LBRACE) return false;
+        if (!stream_pair(pairs + n)) return false;
+        n++;
+        if (scan_finished(&scanner)) {
+            if (!last) return false;
+            break;
+        }
+        if (next_token().type != TOKEN_COMMA) return false;
+        if (scan_finished(&scanner)) {
+            if (last) return false;
+            break;
+        }
+    }
+    *count = n;
+    return true;
+}
+
+void *pair_chunk_worker(void *arg) {
+    PairChunk *chunk = (PairChunk *)arg;
+    BEGIN_BANDWIDTH_BLOCK("parse chunk", chunk->chunk.count)
+    u64 start = read_cpu_timer();
+    chunk->parsed = stream_pair_chunk(chunk->chunk, chunk->last, chunk->pairs, chunk->max_count, &chunk->count);
+    chunk->elapsed = read_cpu_timer() - start;
+    END_BANDWIDTH_BLOCK("parse chunk")
+    fold_thread_profile();
+    return NULL;
+}
+
+// finds the objects of the pairs array, from the opening brace of the first pair to the closing
+// bracket of the array, returning false if the input does not start and end like the layout
+// stream_haversine_pairs expects or the array is empty
+bool find_pairs_array(Buffer input_json, u8 **first, u8 **end) {
+    Buffer pairs_key = { 5, (u8*)("pairs") };
+    begin_scan(&scanner, input_json, select_classifier());
+    if (next_token().type != TOKEN_LBRACE) return false;
+    Token token = next_token();
+    if (token.type != TOKEN_IDENTIFIER || !are_equal(token.identifier, pairs_key)) return false;
+    if (next_token().type != TOKEN_COLON) return false;
+    if (next_token().type != TOKEN_LBRACKET) return false;
+    if (next_token().type != TOKEN_LBRACE) return false;
+    *first = (u8 *)curr_byte - 1;
+
+    u8 *at = input_json.data + input_json.count;
+    while (at > *first && isspace(at[-1])) at--;
+    if (at == *first || *--at != '}') return false;
+    while (at > *first && isspace(at[-1])) at--;
+    if (at == *first || *--at != ']') return false;
+    *end = at;
+    return true;
+}
+
+// splits the pairs array at pair boundaries into a chunk per thread and parses the chunks in
+// parallel, each into the slice of pairs its offset in the input leaves room for, then closes
+// up the gaps between the slices. the chunks are left in chunks for their timings. returns false
+// if the input is not laid out as expected, like stream_haversine_pairs
+bool parallel_stream_haversine_pairs(Buffer input_json, Pair *pairs, u64 max_count, u32 threads,
+                                     PairChunk chunks[MAX_THREADS], u32 *chunks_used, u64 *count) {
+    u8 *first;
+    u8 *end;
+    if (!find_pairs_array(input_json, &first, &end)) {
+        return false;
+    }
+
+    // every chunk starts at the opening brace of a pair; pairs hold no braces of their own
+    u32 chunk_count = 0;
+    u8 *start = first;
+    size_t size = end - first;
+    for (u32 i = 1; i <= threads; i++) {
+        u8 *next = end;
+        if (i < threads) {
+            u8 *target = max(first + size * i / threads, start + 1);
+            next = target < end ? (u8 *)memchr(target, '{', end - target) : NULL;
+            if (next == NULL) {
+                next = end;
+            }
+        }
+        if (next > start) {
+            PairChunk *chunk = chunks + chunk_count++;
+            chunk->chunk = (Buffer){ next - start, start };
+            chunk->last = next == end;
+            chunk->pairs = pairs + (start - first) / MIN_JSON_PAIR_SIZE;
+            chunk->parsed = false;
+            chunk->elapsed = 0;
+            start = next;
+        }
+        if (next == end) {
+            break;
+        }
+    }
+    for (u32 i = 0; i < chunk_count; i++) {
+        Pair *next = i + 1 < chunk_count ? chunks[i + 1].pairs : pairs + max_count;
+        chunks[i].max_count = next - chunks[i].pairs;
+    }
+
+    pthread_t handles[MAX_THREADS];
+    for (u32 i = 0; i < chunk_count; i++) {
+        if (pthread_create(&handles[i], NULL, pair_chunk_worker, chunks + i) != 0) {
+            fprintf(stderr, "ERROR: unable to start parsing thread\n");
+            exit(1);
+        }
+    }
+    for (u32 i = 0; i < chunk_count; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    *chunks_used = chunk_count;
+
+    u64 n = 0;
+    for (u32 i = 0; i < chunk_count; i++) {
+        if (!chunks[i].parsed) {
+            return false;
+        }
+        memmove(pairs + n, chunks[i].pairs, chunks[i].count * sizeof(Pair));
+        n += chunks[i].count;
+    }
+
+    *count = n;
+    return true;
+}
+
+// reports the parallel pass against a single threaded one over the same input: the speedup of
+// the wall time, and the throughput of each thread on its own chunk
+void print_scaling(PairChunk chunks[], u32 chunk_count, u64 parallel_elapsed, u64 single_elapsed) {
+    u64 cpu_freq = estimate_cpu_timer_freq();
+    f64 gigabyte = 1024.0 * 1024.0 * 1024.0;
+    fprintf(stdout, "Scaling: %u threads in %.4fms, one thread in %.4fms", chunk_count,
+            1000.0 * (f64)parallel_elapsed / (f64)cpu_freq, 1000.0 * (f64)single_elapsed / (f64)cpu_freq);
+    if (parallel_elapsed) {
+        fprintf(stdout, ", speedup %.2fx", (f64)single_elapsed / (f64)parallel_elapsed);
+    }
+    fprintf(stdout, "\n");
+    for (u32 i = 0; i < chunk_count; i++) {
+        fprintf(stdout, "  thread %u: %lu bytes in %.4fms", i, chunks[i].chunk.count,
+                1000.0 * (f64)chunks[i].elapsed / (f64)cpu_freq);
+        if (chunks[i].elapsed) {
+            f64 seconds = (f64)chunks[i].elapsed / (f64)cpu_freq;
+            fprintf(stdout, " at %.2fgb/s", (f64)chunks[i].chunk.count / gigabyte / seconds);
+        }
+        fprintf(stdout, "\n");
+    }
+}
+
+// extracts the pairs with the streaming parser, split across threads if asked to, or with the
+// generic one if asked to or if the input is not laid out the way the streaming parser expects
+u64 parse_haversine_pairs(Buffer input_json, Pair *pairs, u64 max_count, bool streaming, u32 threads) {
+    u64 count = 0;
+    if (streaming && threads > 1) {
+        PairChunk chunks[MAX_THREADS];
+        u32 chunk_count = 0;
+        BEGIN_BANDWIDTH_BLOCK("parallel pairs", input_json.count)
+        u64 parallel_start = read_cpu_timer();
+        bool streamed = parallel_stream_haversine_pairs(input_json, pairs, max_count, threads,
+                                                        chunks, &chunk_count, &count);
+        u64 parallel_elapsed = read_cpu_timer() - parallel_start;
+        END_TIME_BLOCK("parallel pairs")
+        if (streamed) {
+            // the same pass on one thread is the baseline the speedup is measured against; it
+            // rewrites the pairs with the same values
+            u64 single_count = 0;
+            BEGIN_BANDWIDTH_BLOCK("stream pairs", input_json.count)
+            u64 single_start = read_cpu_timer();
+            bool single = stream_haversine_pairs(input_json, pairs, max_count, &single_count);
+            u64 single_elapsed = read_cpu_timer() - single_start;
+            END_TIME_BLOCK("stream pairs")
+            if (!single || single_count != count) {
+                fprintf(stderr, "ERROR: parallel and single threaded parses disagree\n");
+                exit(1);
+            }
+            print_scaling(chunks, chunk_count, parallel_elapsed, single_elapsed);
+            return count;
+        }
+        fprintf(stderr, "WARNING: unable to split JSON input, parsing it on one thread\n");
+    }
+    if (streaming) {
+        BEGIN_BANDWIDTH_BLOCK("stream pairs", input_json.count)
+        bool streamed = stream_haversine_pairs(input_json, pairs, max_count, &count);
+        END_TIME_BLOCK("stream pairs")
+        if (streamed) {
+            return count;
+        }
+        fprintf(stderr, "WARNING: unexpected JSON layout, falling back to the generic parser\n");
+    }
+    return parse_dom_haversine_pairs(input_json, pairs, max_count);
+}
+
+// parses every number in the input both with parse_number and with strtod and reports any
+// whose bits differ; returns the number of mismatches
+u64 verify_numbers(Buffer input_json) {
+    u64 checked = 0;
+    u64 mismatches = 0;
+    begin_scan(&scanner, input_json, select_classifier());
+    for (;;) {
+        while (scanner.index_pos == scanner.index_count) {
+            scan_window(&scanner);
+        }
+        const char *at = (const char *)scanner.index[scanner.index_pos++];
+        if (*at == '\0') {
+            break;
+        }
+        if (*at != '-' && !isdigit(*at)) {
+            continue;
+        }
+        f64 fast;
+        const char *end;
+        if (!parse_number(at, &fast, &end)) {
+            continue;
+        }
+        f64 exact = strtod(at, NULL);
+        if (memcmp(&fast, &exact, sizeof(f64)) != 0) {
+            if (mismatches < 10) {
+                fprintf(stderr, "MISMATCH: %.*s parsed as %.17g, strtod gives %.17g\n",
+                        (int)(end - at), at, fast, exact);
+            }
+            mismatches++;
+        }
+        checked++;
+    }
+    fprintf(stdout, "Numbers verified: %lu (%lu mismatches)\n", checked, mismatches);
+    return mismatches;
+}
+
 // ===================================== Main Routine ===================================== //
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "USAGE: %s [coordinate_pairs.json]\n", argv[0]);
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "USAGE: %s [coordinate_pairs.json] [stream/dom/verify] [threads]\n", argv[0]);
+        exit(1);
+    }
+
+    // parse mode of pair extraction
+    bool streaming = true;
+    bool verify = false;
+    if (argc > 2 && strcmp(argv[2], "dom") == 0) {
+        streaming = false;
+    } else if (argc > 2 && strcmp(argv[2], "verify") == 0) {
+        verify = true;
+    } else if (argc > 2 && strcmp(argv[2], "stream") != 0) {
+        fprintf(stderr, "ERROR: unrecognised mode: %s\n", argv[2]);
         exit(1);
     }
 
+    // parse number of threads to stream pairs on
+    u32 threads = 1;
+    if (argc > 3) {
+        char *end;
+        unsigned long value = strtoul(argv[3], &end, 0);
+        if (end == argv[3] || *end != '\0' || value == 0 || value > MAX_THREADS) {
+            fprintf(stderr, "ERROR: thread count must be between 1 and %u\n", MAX_THREADS);
+            exit(1);
+        }
+        threads = (u32)value;
+        if (threads > 1 && !streaming) {
+            fprintf(stderr, "ERROR: only the streaming parser runs on multiple threads\n");
+            exit(1);
+        }
+    }
+
      begin_profiler();
 
     // allocate all memory required for program
@@ -474,9 +777,14 @@ int main(int argc, char *argv[]) {
     fclose(file);
     END_TIME_BLOCK("reading")
 
+    // check the number parser against strtod before trusting it with the pairs
+    if (verify && verify_numbers(input_json) != 0) {
+        exit(1);
+    }
+
     // parse input JSON into haversine pairs
     Pair *pairs = (Pair *)haversine_pairs.data; // cast u8 array to Pair array
-    u64 n = parse_haversine_pairs(input_json, pairs, max_pair_count);
+    u64 n = parse_haversine_pairs(input_json, pairs, max_pair_count, streaming, threads);
 
     // sum haversine distances
     BEGIN_BANDWIDTH_BLOCK("sum", 32 * n)
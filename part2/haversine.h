@@ -21,6 +21,7 @@
 #define len(array) (sizeof(array) / sizeof(array[0]))
 
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef int32_t i32;
 typedef uint32_t u32;
 typedef int64_t i64;
@@ -28,4 +29,9 @@ typedef uint64_t u64;
 
 typedef double f64;
 
+typedef struct {
+    size_t count;
+    u8 *data;
+} Buffer;
+
 #endif //PERF_AWARE_HAVERSINE_H
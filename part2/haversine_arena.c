@@ -0,0 +1,50 @@
+#ifndef PERF_AWARE_HAVERSINE_H
+#include "haversine.h"
+#endif
+
+#define ARENA_BLOCK_SIZE (64 * 1024 * 1024)
+#define ARENA_ALIGNMENT 8
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct ArenaBlock {
+    ArenaBlock *prev;
+    size_t used;
+    size_t capacity;
+    u8 data[];
+};
+
+// bump allocator: allocations are carved out of large blocks one after the other and are
+// never freed individually; releasing the arena frees every block at once
+typedef struct {
+    ArenaBlock *current;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaBlock *block = arena->current;
+    if (block == NULL || block->used + size > block->capacity) {
+        size_t capacity = max(size, ARENA_BLOCK_SIZE);
+        if ((block = (ArenaBlock *) malloc(sizeof(ArenaBlock) + capacity)) == NULL) {
+            fprintf(stderr, "ERROR: unable to allocate %lu bytes\n", capacity);
+            exit(1);
+        }
+        block->prev = arena->current;
+        block->used = 0;
+        block->capacity = capacity;
+        arena->current = block;
+    }
+    void *res = block->data + block->used;
+    block->used += size;
+    return res;
+}
+
+void arena_release(Arena *arena) {
+    ArenaBlock *block = arena->current;
+    while (block != NULL) {
+        ArenaBlock *prev = block->prev;
+        free(block);
+        block = prev;
+    }
+    arena->current = NULL;
+}
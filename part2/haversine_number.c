@@ -0,0 +1,108 @@
+#ifndef PERF_AWARE_HAVERSINE_H
+#include "haversine.h"
+#endif
+
+#define MAX_EXACT_DIGITS 19     // decimal digits that always fit in a u64
+#define MAX_EXACT_POW10 22      // 10^22 is the largest power of ten a double holds exactly
+
+static const f64 exact_powers_of_ten[MAX_EXACT_POW10 + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static const u64 powers_of_ten[MAX_EXACT_DIGITS + 1] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+    1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+    1000000000000000000ull, 10000000000000000000ull,
+};
+
+static inline u32 bit_length(u64 value) {
+    return 64 - __builtin_clzll(value);
+}
+
+// mantissa / 10^scale rounded to the nearest double, ties to even, exactly as strtod would.
+// the quotient is computed to at least 55 bits with 128-bit integer division; the bits past
+// the 53 a double keeps, and whether anything remains, decide the rounding. returns false if
+// the quotient can not be formed that way
+static bool divide_exact(u64 mantissa, u32 scale, f64 *res) {
+    u64 divisor = powers_of_ten[scale];
+    i32 shift = 55 + (i32)bit_length(divisor) - (i32)bit_length(mantissa);
+    if (shift < 0) {
+        return false;
+    }
+    unsigned __int128 numerator = (unsigned __int128)mantissa << shift;
+    unsigned __int128 quotient = numerator / divisor;
+    bool sticky = numerator % divisor != 0;
+
+    // the quotient has 55 or 56 bits; keep 53
+    u32 dropped = bit_length((u64)quotient) - 53;
+    u64 bits = (u64)quotient;
+    u64 kept = bits >> dropped;
+    u64 rest = bits & ((1ull << dropped) - 1);
+    u64 half = 1ull << (dropped - 1);
+    if (rest > half || (rest == half && (sticky || (kept & 1)))) {
+        kept++;
+        if (kept == 1ull << 53) {
+            kept >>= 1;
+            dropped++;
+        }
+    }
+
+    // value == kept * 2^(dropped - shift), with kept in [2^52, 2^53)
+    i32 exponent = (i32)dropped - shift + 52;
+    u64 raw = (u64)(exponent + 1023) << 52 | (kept & ((1ull << 52) - 1));
+    memcpy(res, &raw, sizeof(raw));
+    return true;
+}
+
+// parses a number of the form -?[0-9]+(.[0-9]+)? at text in place, setting *end to the byte after
+// it. returns false if it has no integer digits or no digits after a '.'. small mantissas are
+// converted with one exact division (Clinger's fast path), up to 19 significant digits with a
+// correctly rounded 128-bit division, and anything longer by strtod
+bool parse_number(const char *text, f64 *res, const char **end) {
+    const char *at = text;
+    bool negative = *at == '-';
+    if (negative) {
+        at++;
+    }
+    if (!isdigit(*at)) {
+        return false;
+    }
+
+    u64 mantissa = 0;
+    u32 digits = 0;     // significant digits in mantissa
+    u32 scale = 0;      // digits after the decimal point
+    while (isdigit(*at)) {
+        mantissa = mantissa * 10 + (u64)(*at - '0');
+        digits += digits || mantissa;
+        at++;
+    }
+    if (*at == '.') {
+        at++;
+        if (!isdigit(*at)) {
+            return false;
+        }
+        while (isdigit(*at)) {
+            mantissa = mantissa * 10 + (u64)(*at - '0');
+            digits += digits || mantissa;
+            scale++;
+            at++;
+        }
+    }
+    *end = at;
+
+    f64 value;
+    if (digits > MAX_EXACT_DIGITS) {
+        // the mantissa wrapped around
+        value = strtod(negative ? text + 1 : text, NULL);
+    } else if (mantissa <= (1ull << 53) && scale <= MAX_EXACT_POW10) {
+        value = (f64)mantissa / exact_powers_of_ten[scale];
+    } else if (scale == 0) {
+        value = (f64)mantissa;
+    } else if (scale > MAX_EXACT_DIGITS || !divide_exact(mantissa, scale, &value)) {
+        value = strtod(negative ? text + 1 : text, NULL);
+    }
+    *res = negative ? -value : value;
+    return true;
+}
@@ -9,6 +9,8 @@
 
 #if PROFILER
 
+#include <pthread.h>
+
 #define MAX_ID 32
 
 typedef struct {
@@ -26,9 +28,15 @@ typedef struct {
     u32 anchor_idx;
 } ProfileBlock;
 
-static Profile global_profiles[4096];
-static ProfileBlock stack[1024];
-static u32 sp = 1;
+// kept per thread so that worker threads can run timed code without racing on the anchors;
+// workers fold theirs into thread_profiles when they finish, which is printed along with the
+// main thread's. the blocks of threads running at once add up, so can exceed 100% of the total
+static __thread Profile global_profiles[4096];
+static __thread ProfileBlock stack[1024];
+static __thread u32 sp = 1;
+
+static Profile thread_profiles[len(global_profiles)];
+static pthread_mutex_t thread_profiles_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define NAME_CONCAT(a, b)          a##b
 #define NAME(a, b)                 NAME_CONCAT(a,b)
@@ -71,9 +79,35 @@ void end_block(char const *label) {
     anchor->hit_count += 1;
 }
 
+// adds the anchors of the calling thread into thread_profiles
+void fold_thread_profile(void) {
+    pthread_mutex_lock(&thread_profiles_lock);
+    for (u32 i = 1; i < len(global_profiles); i++) {
+        Profile *from = global_profiles + i;
+        Profile *into = thread_profiles + i;
+        if (from->hit_count) {
+            into->label = from->label;
+            into->tsc_elapsed_exclusive += from->tsc_elapsed_exclusive;
+            into->tsc_elapsed_inclusive += from->tsc_elapsed_inclusive;
+            into->processed_byte_count += from->processed_byte_count;
+            into->hit_count += from->hit_count;
+        }
+    }
+    pthread_mutex_unlock(&thread_profiles_lock);
+}
+
 void print_anchor_results(u64 total_elapsed, u64 cpu_freq) {
     for (u32 i = 1; i < len(global_profiles); i++) {
-        Profile *anchor = global_profiles + i;
+        Profile merged = global_profiles[i];
+        Profile *folded = thread_profiles + i;
+        if (folded->hit_count) {
+            merged.label = folded->label;
+            merged.tsc_elapsed_exclusive += folded->tsc_elapsed_exclusive;
+            merged.tsc_elapsed_inclusive += folded->tsc_elapsed_inclusive;
+            merged.processed_byte_count += folded->processed_byte_count;
+            merged.hit_count += folded->hit_count;
+        }
+        Profile *anchor = &merged;
         if (anchor->tsc_elapsed_inclusive) {
             f64 percent = 100.0 * ((f64)anchor->tsc_elapsed_exclusive / (f64)total_elapsed);
             printf(" %s[%lu]: %lu (%.2f%%", anchor->label, anchor->hit_count, anchor->tsc_elapsed_exclusive, percent);
@@ -106,6 +140,7 @@ void print_anchor_results(u64 total_elapsed, u64 cpu_freq) {
 #define BEGIN_BANDWIDTH_BLOCK(...)
 #define END_BANDWIDTH_BLOCK(...)
 #define print_anchor_results(...)
+#define fold_thread_profile()
 
 #endif
 
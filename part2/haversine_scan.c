@@ -0,0 +1,193 @@
+#ifndef PERF_AWARE_HAVERSINE_H
+#include "haversine.h"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_SIMD 1
+#else
+#define SCAN_SIMD 0
+#endif
+
+#define SCAN_BLOCK_SIZE 64              // bytes classified at a time, one per bit of a u64
+#define SCAN_WINDOW_SIZE (16 * 1024)    // bytes indexed per refill of the token index
+
+// ==================================== Structural Scan =================================== //
+
+// first pass over the JSON input in the style of simdjson's stage 1: each 64 byte block is
+// classified into quotes, whitespace and operators ({}[]:,) as bitmasks, from which the start
+// of every token is found without looking at the bytes one at a time. tokens are operators
+// and opening quotes outside strings, plus the first byte of each run of anything else (the
+// numbers). the tokenizer then jumps from token to token instead of skipping whitespace.
+// escaped quotes are not recognised, as the tokenizer does not handle them either
+
+typedef struct {
+    u64 quote;
+    u64 whitespace;
+    u64 op;
+} BlockClasses;
+
+typedef BlockClasses ClassifyFunction(const u8 *block);
+
+typedef struct {
+    const u8 *data;         // input, followed by a terminating null byte
+    size_t count;
+    size_t scanned;         // bytes of input indexed so far
+    u64 in_string;          // all ones if the last block scanned ended inside a string
+    u64 prev_scalar;        // 1 if the last block scanned ended in a number (or other scalar)
+    ClassifyFunction *classify;
+    u8 *index[SCAN_WINDOW_SIZE + 1];    // start of every token in the window scanned last
+    u32 index_count;
+    u32 index_pos;          // next token to hand out
+} StructuralScanner;
+
+enum {
+    CLASS_QUOTE = 1 << 0,
+    CLASS_WHITESPACE = 1 << 1,
+    CLASS_OP = 1 << 2,
+};
+
+static const u8 byte_classes[256] = {
+    ['"'] = CLASS_QUOTE,
+    [' '] = CLASS_WHITESPACE, ['\t'] = CLASS_WHITESPACE, ['\n'] = CLASS_WHITESPACE, ['\r'] = CLASS_WHITESPACE,
+    ['{'] = CLASS_OP, ['}'] = CLASS_OP, ['['] = CLASS_OP, [']'] = CLASS_OP, [':'] = CLASS_OP, [','] = CLASS_OP,
+};
+
+BlockClasses classify_scalar(const u8 *block) {
+    BlockClasses res = {};
+    for (u32 i = 0; i < SCAN_BLOCK_SIZE; i++) {
+        u8 class = byte_classes[block[i]];
+        res.quote |= (u64)((class & CLASS_QUOTE) != 0) << i;
+        res.whitespace |= (u64)((class & CLASS_WHITESPACE) != 0) << i;
+        res.op |= (u64)((class & CLASS_OP) != 0) << i;
+    }
+    return res;
+}
+
+#if SCAN_SIMD
+
+// brackets and braces differ from each other only in bit 5: '[' | 0x20 == '{', ']' | 0x20 == '}'
+BlockClasses classify_sse2(const u8 *block) {
+    BlockClasses res = {};
+    for (u32 i = 0; i < SCAN_BLOCK_SIZE; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i quote = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+        __m128i whitespace = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        __m128i op = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        res.quote |= (u64)(u16)_mm_movemask_epi8(quote) << i;
+        res.whitespace |= (u64)(u16)_mm_movemask_epi8(whitespace) << i;
+        res.op |= (u64)(u16)_mm_movemask_epi8(op) << i;
+    }
+    return res;
+}
+
+__attribute__((target("avx2")))
+BlockClasses classify_avx2(const u8 *block) {
+    BlockClasses res = {};
+    for (u32 i = 0; i < SCAN_BLOCK_SIZE; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+        __m256i folded = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i quote = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+        __m256i whitespace = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        __m256i op = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+        res.quote |= (u64)(u32)_mm256_movemask_epi8(quote) << i;
+        res.whitespace |= (u64)(u32)_mm256_movemask_epi8(whitespace) << i;
+        res.op |= (u64)(u32)_mm256_movemask_epi8(op) << i;
+    }
+    return res;
+}
+
+#endif
+
+// picks the widest classifier the cpu supports
+ClassifyFunction *select_classifier(void) {
+#if SCAN_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return classify_avx2;
+    }
+    return classify_sse2;
+#else
+    return classify_scalar;
+#endif
+}
+
+// each bit set to the xor of itself and every bit below it, so the bits from an opening quote up
+// to (but excluding) its closing quote are set
+static inline u64 prefix_xor(u64 bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+void begin_scan(StructuralScanner *scanner, Buffer input, ClassifyFunction *classify) {
+    scanner->data = input.data;
+    scanner->count = input.count;
+    scanner->scanned = 0;
+    scanner->in_string = 0;
+    scanner->prev_scalar = 0;
+    scanner->classify = classify;
+    scanner->index_count = 0;
+    scanner->index_pos = 0;
+}
+
+// replaces the token index with the tokens of the next window of input; past the end of the
+// input the index holds just the terminating null byte
+void scan_window(StructuralScanner *scanner) {
+    BEGIN_BANDWIDTH_BLOCK("scan", min(scanner->count - scanner->scanned, SCAN_WINDOW_SIZE))
+    u32 n = 0;
+    size_t end = min(scanner->scanned + SCAN_WINDOW_SIZE, scanner->count);
+    for (size_t at = scanner->scanned; at < end; at += SCAN_BLOCK_SIZE) {
+        const u8 *block = scanner->data + at;
+        u8 padded[SCAN_BLOCK_SIZE];
+        if (end - at < SCAN_BLOCK_SIZE) {
+            // the bytes past the input read as whitespace
+            memset(padded, ' ', SCAN_BLOCK_SIZE);
+            memcpy(padded, block, end - at);
+            block = padded;
+        }
+        BlockClasses classes = scanner->classify(block);
+
+        u64 in_string = prefix_xor(classes.quote) ^ scanner->in_string;
+        u64 scalar = ~(classes.quote | classes.whitespace | classes.op);
+        u64 scalar_start = scalar & ~(scalar << 1 | scanner->prev_scalar);
+        u64 tokens = ((classes.op | scalar_start) & ~in_string) | (classes.quote & in_string);
+        scanner->in_string = (u64)((i64)in_string >> 63);
+        scanner->prev_scalar = scalar >> 63;
+
+        while (tokens) {
+            scanner->index[n++] = (u8 *)scanner->data + at + __builtin_ctzll(tokens);
+            tokens &= tokens - 1;
+        }
+    }
+    scanner->scanned = end;
+    if (n == 0 && end == scanner->count) {
+        scanner->index[n++] = (u8 *)scanner->data + scanner->count;
+    }
+    scanner->index_count = n;
+    scanner->index_pos = 0;
+    END_BANDWIDTH_BLOCK("scan")
+}
+
+// true once every token of the input has been handed out, bar the terminating null byte
+bool scan_finished(StructuralScanner *scanner) {
+    while (scanner->index_pos == scanner->index_count) {
+        if (scanner->scanned == scanner->count) {
+            return true;
+        }
+        scan_window(scanner);
+    }
+    return scanner->index[scanner->index_pos] == scanner->data + scanner->count;
+}